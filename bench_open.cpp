@@ -0,0 +1,82 @@
+// Open-time benchmark for the storage backends and the line indexer.
+//
+//   g++ -O2 -std=c++17 -pthread bench_open.cpp editor.cpp -o bench_open
+//   ./bench_open [file] [threads...]
+//
+// Without a file, a 1 GiB synthetic log is generated in /tmp. Thread counts
+// default to 1 and the hardware thread count.
+#include "editor.hpp"
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <thread>
+
+static double secondsSince(chrono::steady_clock::time_point start) {
+  return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+static string makeSampleFile() {
+  string path = "/tmp/terminaltext_bench.log";
+  ofstream out(path, ios::binary);
+  mt19937 rng(1);
+  string line;
+  for (size_t written = 0; written < (size_t(1) << 30); written += line.size()) {
+    line = "2024-01-01T00:00:00Z INFO request id=" + to_string(rng()) + " latency_ms=" + to_string(rng() % 1000);
+    line.append(rng() % 120, 'x');
+    line += '\n';
+    out << line;
+  }
+  return path;
+}
+
+static string readAll(const string& path) {
+  ifstream file(path, ios::binary | ios::ate);
+  string text(file.tellg(), '\0');
+  file.seekg(0);
+  file.read(text.data(), text.size());
+  return text;
+}
+
+int main(int argc, char* argv[]) {
+  string path = argc > 1 ? argv[1] : makeSampleFile();
+  vector<unsigned> threadCounts;
+  for (int i = 2; i < argc; i++) threadCounts.push_back(stoul(argv[i]));
+  if (threadCounts.empty()) threadCounts = {1, max(1u, thread::hardware_concurrency())};
+
+  string text = readAll(path);
+  double gib = text.size() / double(1 << 30);
+  cout << path << ": " << fixed << setprecision(2) << gib << " GiB\n\n";
+
+  cout << "indexNewlines (file already in memory)\n";
+  for (unsigned threads : threadCounts) {
+    vector<size_t> offsets;
+    auto start = chrono::steady_clock::now();
+    indexNewlines(text.data(), text.size(), 0, offsets, threads);
+    double secs = secondsSince(start);
+    cout << "  threads=" << setw(3) << threads << "  " << setw(8) << secs * 1000 << " ms  "
+         << setw(6) << gib / secs << " GiB/s  " << offsets.size() << " lines\n";
+  }
+  text.clear();
+  text.shrink_to_fit();
+
+  const char* names[] = {"lines", "arena", "piece", "rope", "mmap"};
+  cout << "\nBuffer open: first screen / full line count\n";
+  for (const char* name : names) {
+    for (unsigned threads : threadCounts) {
+      BufferOptions options;
+      parseStorageKind(name, options.storage);
+      options.indexThreads = threads;
+      auto start = chrono::steady_clock::now();
+      Buffer buffer(path, options);
+      for (int row = 0; row < 50; row++) buffer.getLine(row);
+      double firstScreen = secondsSince(start);
+      int lines = buffer.getLineCount();
+      double total = secondsSince(start);
+      cout << "  " << setw(5) << name << " threads=" << setw(3) << threads << "  " << setw(8)
+           << firstScreen * 1000 << " ms  " << setw(8) << total * 1000 << " ms  " << lines << " lines\n";
+    }
+  }
+  return 0;
+}
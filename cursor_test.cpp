@@ -0,0 +1,91 @@
+// Regression test for typing with many cursors in a buffer that reads its
+// text from the file: mapped and paged storage.
+//
+//   g++ -O2 -std=c++17 -pthread cursor_test.cpp editor.cpp -o cursor_test
+//   ./cursor_test
+//
+// Exits with status 1 and names the case if the document differs from the
+// text the keys should have produced, or if the keys took so long that each
+// batch of edits is no longer applied in one pass.
+#include "editor.hpp"
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+static void writeFile(const string& path, const string& text) {
+  ofstream(path, ios::binary | ios::trunc) << text;
+}
+
+static string readFile(const string& path) {
+  ifstream in(path, ios::binary);
+  stringstream out;
+  out << in.rdbuf();
+  return out.str();
+}
+
+// Types `keys` at a cursor on every `every`th line, column 2, then erases
+// them again with as many backspaces, checking the saved file after each.
+static bool typeThenErase(const string& name, StorageKind storage, int lines, int every, const string& keys) {
+  string path = "/tmp/terminaltext_cursor_test.txt";
+  string text;
+  for (int i = 0; i < lines; i++) text += "line " + to_string(i) + "\n";
+  writeFile(path, text);
+  BufferOptions options;
+  options.storage = storage;
+  options.persistUndo = false;
+  Buffer buffer(path, options);
+
+  vector<size_t> cursors;
+  for (int row = 0; row < lines; row += every) cursors.push_back(buffer.offsetOf(row, 2));
+  string typed;
+  for (size_t i = 0, from = 0; i <= cursors.size(); i++) {
+    size_t to = i < cursors.size() ? cursors[i] : text.size();
+    typed += text.substr(from, to - from);
+    if (i < cursors.size()) typed += keys;
+    from = to;
+  }
+
+  auto start = chrono::steady_clock::now();
+  for (size_t k = 0; k < keys.size(); k++) {
+    vector<Edit> edits;
+    for (size_t c = 0; c < cursors.size(); c++) edits.push_back(Edit{cursors[c] + c * k + k, 0, string(1, keys[k])});
+    buffer.applyEdits(edits);
+  }
+  double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+  buffer.save();
+  if (readFile(path) != typed) {
+    cerr << name << ": typed text differs\n";
+    return false;
+  }
+  start = chrono::steady_clock::now();
+  for (size_t k = keys.size(); k > 0; k--) {
+    vector<Edit> edits;
+    for (size_t c = 0; c < cursors.size(); c++) edits.push_back(Edit{cursors[c] + c * k + k - 1, 1, ""});
+    buffer.applyEdits(edits);
+  }
+  seconds += chrono::duration<double>(chrono::steady_clock::now() - start).count();
+  buffer.save();
+  if (readFile(path) != text) {
+    cerr << name << ": text after the backspaces differs\n";
+    return false;
+  }
+  // One edit at a time took over a minute here; a pass per batch takes
+  // around a second.
+  if (seconds > 20) {
+    cerr << name << ": " << cursors.size() << " cursors took " << seconds << " s\n";
+    return false;
+  }
+  return true;
+}
+
+int main() {
+  bool ok = true;
+  for (StorageKind storage : {StorageKind::Mapped, StorageKind::Paged}) {
+    string kind = storage == StorageKind::Mapped ? "mapped, " : "paged, ";
+    ok &= typeThenErase(kind + "every line", storage, 20000, 1, "ab\ncd");
+    ok &= typeThenErase(kind + "every 10th line", storage, 200000, 10, "xyz");
+  }
+  if (ok) cout << "ok\n";
+  return ok ? 0 : 1;
+}
@@ -4,8 +4,30 @@
 #include <termios.h>
 #include <unistd.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
 #include <cstdlib>
 #include <filesystem>
+#include <algorithm>
+#include <cstring>
+#include <iterator>
+#include <list>
+#include <string_view>
+#include <unordered_map>
+#include <chrono>
+#include <system_error>
+#include <sys/uio.h>
+#include <cstdint>
+#include <atomic>
+#include <thread>
+#include <array>
+#include <set>
+#include <sys/inotify.h>
+#include <poll.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 namespace fs = std::filesystem;
 
@@ -55,81 +77,3951 @@ std::pair<int, int> Terminal::getWindowSize() {
 
 void SyntaxHighlighter::addRule(const std::string& pattern, const std::string& color) {
     rules.push_back({std::regex(pattern), color});
+    cache.clear();
 }
 
 std::string SyntaxHighlighter::highlight(const std::string& line) {
-    std::string result = line;
-    for (const auto& rule : rules) {
-        std::smatch match;
-        std::string temp = result;
-        result.clear();
-        std::string::const_iterator searchStart(temp.cbegin());
-        
-        while (std::regex_search(searchStart, temp.cend(), match, rule.pattern)) {
-            result.append(searchStart, searchStart + match.position());
-            result.append(rule.color);
-            result.append(match.str());
-            result.append("\x1b[0m");
-            searchStart = searchStart + match.position() + match.length();
-        }
-        result.append(searchStart, temp.cend());
+    std::string result;
+    highlight(line, result);
+    return result;
+}
+
+// Matches all rules against the plain text, so no copy of the line is
+// made per rule and later rules never see the escape codes of earlier ones.
+void SyntaxHighlighter::findSpans(std::string_view line, std::vector<Span>& spans) {
+    spans.clear();
+    const char* begin = line.data();
+    const char* end = begin + line.size();
+    for (size_t r = 0; r < rules.size(); r++) {
+        for (const char* pos = begin; pos < end;) {
+            auto flags = pos == begin ? std::regex_constants::match_default : std::regex_constants::match_prev_avail;
+            if (!std::regex_search(pos, end, match, rules[r].pattern, flags)) break;
+            size_t first = match[0].first - begin, last = match[0].second - begin;
+            pos = match[0].second + (first == last);
+            if (first == last) continue;
+            auto it = std::lower_bound(spans.begin(), spans.end(), first,
+                                       [](const Span& s, size_t offset) { return s.end <= offset; });
+            if (it == spans.end() || it->begin >= last) spans.insert(it, Span{first, last, r});
+        }
+    }
+}
+
+// A line found in the cache is emitted without matching, and a slot that
+// is reused keeps its capacity, so redrawing unchanged text allocates
+// nothing.
+void SyntaxHighlighter::highlight(std::string_view line, std::string& out) {
+    size_t hash = std::hash<std::string_view>()(line);
+    const CachedLine* found = nullptr;
+    for (const auto& cached : cache) {
+        if (cached.hash == hash && cached.text == line) {
+            found = &cached;
+            break;
+        }
+    }
+    if (!found) {
+        CachedLine& slot = cache.size() < CacheLines ? cache.emplace_back() : cache[nextSlot++ % CacheLines];
+        slot.hash = hash;
+        slot.text.assign(line);
+        findSpans(line, slot.spans);
+        found = &slot;
+    }
+    out.clear();
+    size_t done = 0;
+    for (const Span& s : found->spans) {
+        out.append(line, done, s.begin - done);
+        out += rules[s.rule].color;
+        out.append(line, s.begin, s.end - s.begin);
+        out += "\x1b[0m";
+        done = s.end;
+    }
+    out.append(line, done);
+}
+
+// Compiled patterns are opaque and not counted.
+size_t SyntaxHighlighter::memoryUsage() const {
+    size_t bytes = cache.capacity() * sizeof(CachedLine) + match.size() * sizeof(std::csub_match);
+    for (const auto& cached : cache) bytes += cached.text.capacity() + cached.spans.capacity() * sizeof(Span);
+    for (const auto& rule : rules) bytes += rule.color.capacity();
+    return bytes;
+}
+
+namespace {
+
+void newlinesScalar(const char* data, size_t len, size_t base, std::vector<size_t>& out) {
+    const char* end = data + len;
+    for (const char* p = data; (p = static_cast<const char*>(memchr(p, '\n', end - p))); p++) {
+        out.push_back(base + (p - data));
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+void emitMask(uint64_t mask, size_t pos, std::vector<size_t>& out) {
+    for (; mask; mask &= mask - 1) out.push_back(pos + __builtin_ctzll(mask));
+}
+
+__attribute__((target("sse2")))
+void newlinesSse2(const char* data, size_t len, size_t base, std::vector<size_t>& out) {
+    const __m128i nl = _mm_set1_epi8('\n');
+    size_t i = 0;
+    for (; i + 64 <= len; i += 64) {
+        uint64_t mask = 0;
+        for (int k = 0; k < 4; k++) {
+            __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i + 16 * k));
+            mask |= uint64_t(uint16_t(_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, nl)))) << (16 * k);
+        }
+        emitMask(mask, base + i, out);
+    }
+    newlinesScalar(data + i, len - i, base + i, out);
+}
+
+__attribute__((target("avx2")))
+void newlinesAvx2(const char* data, size_t len, size_t base, std::vector<size_t>& out) {
+    const __m256i nl = _mm256_set1_epi8('\n');
+    size_t i = 0;
+    for (; i + 64 <= len; i += 64) {
+        __m256i lo = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i));
+        __m256i hi = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i + 32));
+        uint64_t mask = uint32_t(_mm256_movemask_epi8(_mm256_cmpeq_epi8(lo, nl))) |
+                        uint64_t(uint32_t(_mm256_movemask_epi8(_mm256_cmpeq_epi8(hi, nl)))) << 32;
+        emitMask(mask, base + i, out);
+    }
+    newlinesScalar(data + i, len - i, base + i, out);
+}
+#endif
+
+using NewlineIndexer = void (*)(const char*, size_t, size_t, std::vector<size_t>&);
+
+NewlineIndexer pickNewlineIndexer() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) return newlinesAvx2;
+    if (__builtin_cpu_supports("sse2")) return newlinesSse2;
+#endif
+    return newlinesScalar;
+}
+
+// Workers to start for a request of `threads`, 0 meaning one per
+// hardware thread.
+unsigned workerCount(unsigned threads) {
+    if (threads == 0) return std::max(1u, std::thread::hardware_concurrency());
+    return std::min(threads, maxIndexThreads());
+}
+
+template <typename F>
+void parallelFor(size_t count, unsigned threads, F f) {
+    std::atomic<size_t> next{0};
+    auto worker = [&] {
+        for (size_t i; (i = next++) < count;) f(i);
+    };
+    std::vector<std::thread> pool;
+    for (unsigned t = 1; t < threads; t++) pool.emplace_back(worker);
+    worker();
+    for (auto& t : pool) t.join();
+}
+
+}
+
+unsigned maxIndexThreads() {
+    return 4 * std::max(1u, std::thread::hardware_concurrency());
+}
+
+// Large inputs are cut into several chunks per thread so uneven line
+// density still balances. Each chunk gets its own offset table and the
+// tables are copied into place at prefix-summed positions.
+void indexNewlines(const char* data, size_t len, size_t base, std::vector<size_t>& out, unsigned threads) {
+    static const NewlineIndexer indexer = pickNewlineIndexer();
+    threads = workerCount(threads);
+    if (threads == 1 || len < ParallelIndexThreshold) {
+        indexer(data, len, base, out);
+        return;
+    }
+    size_t chunks = threads * 4;
+    size_t chunkSize = (len + chunks - 1) / chunks;
+    std::vector<std::vector<size_t>> tables(chunks);
+    parallelFor(chunks, threads, [&](size_t i) {
+        size_t start = std::min(len, i * chunkSize);
+        size_t end = std::min(len, start + chunkSize);
+        indexer(data + start, end - start, base + start, tables[i]);
+    });
+    std::vector<size_t> offsets(chunks + 1, out.size());
+    for (size_t i = 0; i < chunks; i++) offsets[i + 1] = offsets[i] + tables[i].size();
+    out.resize(offsets[chunks]);
+    parallelFor(chunks, threads, [&](size_t i) {
+        std::copy(tables[i].begin(), tables[i].end(), out.begin() + offsets[i]);
+        std::vector<size_t>().swap(tables[i]);
+    });
+}
+
+namespace {
+
+// The text of a file, without its final newline.
+std::string readText(const std::string& path) {
+    std::string text;
+    std::ifstream file(path, std::ios::binary | std::ios::ate);
+    if (file.is_open()) {
+        text.resize(file.tellg());
+        file.seekg(0);
+        file.read(text.data(), text.size());
+        if (!text.empty() && text.back() == '\n') text.pop_back();
+    }
+    return text;
+}
+
+}
+
+void TextStorage::load(const std::string& path) {
+    assign(readText(path));
+}
+
+size_t TextStorage::rowAt(size_t offset) const {
+    size_t lo = 0, hi = lineCount();
+    while (lo + 1 < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (offsetOf(mid) <= offset) lo = mid;
+        else hi = mid;
+    }
+    return lo;
+}
+
+std::string_view TextStorage::lineView(size_t row, size_t col, size_t len, std::string& scratch) const {
+    scratch = line(row);
+    return col < scratch.size() ? std::string_view(scratch).substr(col, len) : std::string_view();
+}
+
+std::string TextStorage::line(size_t row, size_t col, size_t len) const {
+    std::string scratch;
+    return std::string(lineView(row, col, len, scratch));
+}
+
+std::string TextStorage::read(size_t offset, size_t len) const {
+    std::string result, scratch;
+    while (result.size() < len) {
+        std::string_view chunk = chunkAt(offset + result.size(), scratch);
+        if (chunk.empty()) break;
+        result.append(chunk.substr(0, len - result.size()));
+    }
+    if (result.size() < len && offset + result.size() == size()) result += '\n';
+    return result;
+}
+
+std::string TextStorage::read(size_t row, size_t col, size_t len) const {
+    return read(offsetOf(row) + col, len);
+}
+
+// Positions are worked out before anything changes, since applying an edit
+// moves the text after it.
+std::vector<std::string> TextStorage::apply(const std::vector<Edit>& edits) {
+    std::vector<std::pair<size_t, size_t>> at;
+    std::vector<std::string> removed;
+    at.reserve(edits.size());
+    removed.reserve(edits.size());
+    for (const auto& edit : edits) {
+        size_t row = rowAt(edit.offset);
+        at.emplace_back(row, edit.offset - offsetOf(row));
+        removed.push_back(read(edit.offset, edit.length));
+    }
+    for (size_t i = edits.size(); i-- > 0;) {
+        auto [row, col] = at[i];
+        if (edits[i].length > 0) erase(row, col, edits[i].length);
+        if (!edits[i].text.empty()) insert(row, col, edits[i].text);
+    }
+    return removed;
+}
+
+void TextStorage::append(const std::string& text) {
+    size_t row = lineCount() - 1;
+    if (!text.empty()) insert(row, lineLength(row), text);
+}
+
+// Line by line: the text of a line, then its newline on its own.
+std::string_view TextStorage::chunkAt(size_t offset, std::string& scratch) const {
+    if (offset >= size()) return {};
+    size_t row = rowAt(offset);
+    std::string_view text = lineView(row, offset - offsetOf(row), std::string::npos, scratch);
+    return text.empty() ? std::string_view("\n") : text;
+}
+
+std::string_view TextStorage::chunkBefore(size_t offset, std::string& scratch) const {
+    offset = std::min(offset, size());
+    if (offset == 0) return {};
+    size_t row = rowAt(offset - 1);
+    size_t col = offset - 1 - offsetOf(row);
+    if (col == lineLength(row)) return "\n";
+    return lineView(row, 0, col + 1, scratch);
+}
+
+bool ChunkCursor::next(std::string_view& chunk) {
+    chunk = storage->chunkAt(offset, scratch);
+    offset += chunk.size();
+    return !chunk.empty();
+}
+
+bool ChunkCursor::prev(std::string_view& chunk) {
+    chunk = storage->chunkBefore(offset, scratch);
+    offset = std::min(offset, storage->size()) - chunk.size();
+    return !chunk.empty();
+}
+
+namespace {
+
+// Heap bytes behind a string, which keeps short text inline.
+size_t heapBytes(const std::string& s) {
+    static const size_t inlineCapacity = std::string().capacity();
+    return s.capacity() > inlineCapacity ? s.capacity() + 1 : 0;
+}
+
+template <typename T>
+size_t heapBytes(const std::vector<T>& v) {
+    return v.capacity() * sizeof(T);
+}
+
+size_t heapBytes(const std::vector<std::string>& v) {
+    size_t bytes = v.capacity() * sizeof(std::string);
+    for (const auto& s : v) bytes += heapBytes(s);
+    return bytes;
+}
+
+std::vector<std::string> splitLines(const std::string& text, unsigned threads = 1) {
+    std::vector<size_t> breaks;
+    indexNewlines(text.data(), text.size(), 0, breaks, threads);
+    std::vector<std::string> lines;
+    lines.reserve(breaks.size() + 1);
+    size_t start = 0;
+    for (size_t nl : breaks) {
+        lines.emplace_back(text, start, nl - start);
+        start = nl + 1;
+    }
+    lines.emplace_back(text, start);
+    return lines;
+}
+
+void insertIntoLines(std::vector<std::string>& lines, size_t row, size_t col, const std::string& text) {
+    size_t nl = text.find('\n');
+    if (nl == std::string::npos) {
+        lines[row].insert(col, text);
+        return;
+    }
+    std::string tail = lines[row].substr(col);
+    lines[row].replace(col, std::string::npos, text, 0, nl);
+    auto added = splitLines(text.substr(nl + 1));
+    added.back() += tail;
+    lines.insert(lines.begin() + row + 1, added.begin(), added.end());
+}
+
+void eraseFromLines(std::vector<std::string>& lines, size_t row, size_t col, size_t len) {
+    size_t endRow = row, endCol = col + len;
+    while (endCol > lines[endRow].size() && endRow + 1 < lines.size()) {
+        endCol -= lines[endRow].size() + 1;
+        endRow++;
+    }
+    endCol = std::min(endCol, lines[endRow].size());
+    if (endRow == row) {
+        lines[row].erase(col, endCol - col);
+        return;
+    }
+    lines[row].replace(col, std::string::npos, lines[endRow], endCol, std::string::npos);
+    lines.erase(lines.begin() + row + 1, lines.begin() + endRow + 1);
+}
+
+// A run of whole lines touched by one or more edits, and the lines that
+// replace it once they are applied.
+struct LineRewrite {
+    size_t row, count;
+    std::vector<std::string> lines;
+};
+
+// Groups sorted, non-overlapping edits by the lines they touch and splices
+// each group in a single pass, so k edits on a line of length n cost
+// O(k + n) rather than O(k * n). The text each edit removes goes to
+// `removed`.
+std::vector<LineRewrite> lineRewrites(const TextStorage& storage, const std::vector<Edit>& edits,
+                                      std::vector<std::string>& removed) {
+    std::vector<LineRewrite> runs;
+    std::string text, scratch;
+    size_t pos = 0, lastRow = 0;
+    // Copies the text from `pos` to `end` to `out` a line at a time.
+    auto copyTo = [&](size_t end, std::string& out) {
+        for (size_t row = storage.rowAt(pos); pos < end; row++) {
+            size_t col = pos - storage.offsetOf(row);
+            std::string_view view = storage.lineView(row, col, end - pos, scratch);
+            out.append(view);
+            pos += view.size();
+            if (pos < end) {
+                out += '\n';
+                pos++;
+            }
+        }
+    };
+    removed.assign(edits.size(), std::string());
+    auto close = [&] {
+        copyTo(storage.offsetOf(lastRow) + storage.lineLength(lastRow), text);
+        runs.back().count = lastRow - runs.back().row + 1;
+        runs.back().lines = splitLines(text);
+    };
+    for (size_t i = 0; i < edits.size(); i++) {
+        const Edit& edit = edits[i];
+        size_t row = storage.rowAt(edit.offset);
+        if (runs.empty() || row > lastRow) {
+            if (!runs.empty()) close();
+            runs.push_back(LineRewrite{row, 0, {}});
+            pos = storage.offsetOf(row);
+            text.clear();
+        }
+        copyTo(edit.offset, text);
+        copyTo(edit.offset + edit.length, removed[i]);
+        text += edit.text;
+        lastRow = std::max(lastRow, storage.rowAt(pos));
+    }
+    if (!runs.empty()) close();
+    return runs;
+}
+
+bool keepsLineCount(const std::vector<LineRewrite>& runs) {
+    return std::all_of(runs.begin(), runs.end(), [](const LineRewrite& r) { return r.lines.size() == r.count; });
+}
+
+// Fenwick tree over line lengths, each counting its newline, so the start
+// of a line and the line holding an offset both cost O(log n). Edits within
+// a line are O(log n) updates; adding or removing lines rebuilds it in
+// O(n), the same order as shifting the lines themselves.
+class LineIndex {
+    std::vector<size_t> tree{0};  // 1-based
+
+public:
+    template <typename Lines>
+    void build(const Lines& lines) {
+        tree.assign(lines.size() + 1, 0);
+        for (size_t i = 1; i < tree.size(); i++) {
+            tree[i] += lines[i - 1].size() + 1;
+            size_t parent = i + (i & -i);
+            if (parent < tree.size()) tree[parent] += tree[i];
+        }
+    }
+
+    // Adjusts the length of `row`; unsigned wraparound handles shrinking.
+    void resize(size_t row, size_t oldLength, size_t newLength) {
+        for (size_t i = row + 1; i < tree.size(); i += i & -i) tree[i] += newLength - oldLength;
+    }
+
+    size_t memoryUsage() const { return heapBytes(tree); }
+
+    // Adds a row of `length` bytes after the last one.
+    void push(size_t length) {
+        size_t i = tree.size();
+        tree.push_back(length + 1 + offsetOf(i - 1) - offsetOf(i - (i & -i)));
+    }
+
+    size_t offsetOf(size_t row) const {
+        size_t offset = 0;
+        for (size_t i = row; i > 0; i -= i & -i) offset += tree[i];
+        return offset;
+    }
+
+    size_t rowAt(size_t offset) const {
+        size_t row = 0, step = 1;
+        while (step * 2 < tree.size()) step *= 2;
+        for (; step > 0; step /= 2) {
+            if (row + step < tree.size() && tree[row + step] <= offset) {
+                row += step;
+                offset -= tree[row];
+            }
+        }
+        return std::min(row, tree.size() - 2);
+    }
+};
+
+// Lines in blocks that clones share, so a clone costs one pointer per
+// block instead of a copy of every line, and the first edit while a clone
+// is alive copies only the blocks it touches. Each block keeps a LineIndex
+// of its own, and running line and byte totals per block find the block
+// holding a row or an offset by binary search. An edit within a line
+// adjusts the totals after its block; adding or removing lines rebuilds
+// the blocks it touches, which hold up to 2 * BlockLines lines each.
+// `Line` is anything with a size(): the text itself, or a reference to it.
+template <typename Line>
+class BlockedLines {
+    static constexpr size_t BlockLines = 1024;
+
+    struct Block {
+        std::vector<Line> lines;
+        LineIndex index;
+    };
+
+    std::vector<std::shared_ptr<Block>> blocks;
+    // rows[i] and bytes[i] are the lines and bytes, newlines included, in
+    // blocks 0..i.
+    std::vector<size_t> rows, bytes;
+
+    size_t rowsBefore(size_t b) const { return b > 0 ? rows[b - 1] : 0; }
+    size_t bytesBefore(size_t b) const { return b > 0 ? bytes[b - 1] : 0; }
+
+    // The block holding `row`, and the row within it.
+    size_t locate(size_t row, size_t& within) const {
+        size_t b = std::upper_bound(rows.begin(), rows.end(), row) - rows.begin();
+        within = row - rowsBefore(b);
+        return b;
+    }
+
+    // Block `b`, copied first while a clone shares it.
+    Block& writable(size_t b) {
+        if (blocks[b].use_count() > 1) blocks[b] = std::make_shared<Block>(*blocks[b]);
+        else std::atomic_thread_fence(std::memory_order_acquire);
+        return *blocks[b];
+    }
+
+    // Moves `lines` into blocks of BlockLines, the last one taking up to
+    // twice that, at the end of `out`.
+    static void cut(std::vector<Line>& lines, std::vector<std::shared_ptr<Block>>& out) {
+        for (size_t start = 0, end; start < lines.size(); start = end) {
+            end = lines.size() - start < 2 * BlockLines ? lines.size() : start + BlockLines;
+            auto block = std::make_shared<Block>();
+            block->lines.assign(std::make_move_iterator(lines.begin() + start), std::make_move_iterator(lines.begin() + end));
+            block->index.build(block->lines);
+            out.push_back(std::move(block));
+        }
+        lines.clear();
+    }
+
+    void recount(size_t first) {
+        rows.resize(blocks.size());
+        bytes.resize(blocks.size());
+        for (size_t b = first; b < blocks.size(); b++) {
+            rows[b] = rowsBefore(b) + blocks[b]->lines.size();
+            bytes[b] = bytesBefore(b) + blocks[b]->index.offsetOf(blocks[b]->lines.size());
+        }
+    }
+
+    // Replaces the lines of each run, for runs sorted by row that do not
+    // overlap, in one pass over the blocks they touch. Blocks between runs
+    // stay as they are unless the rebuilt lines before one are too few to
+    // make a block of their own; then they take it in.
+    template <typename Make>
+    void splice(std::vector<LineRewrite>& runs, Make make) {
+        size_t at;
+        size_t first = locate(runs.front().row, at), b = first;
+        at = 0;
+        std::vector<std::shared_ptr<Block>> result;
+        std::vector<Line> pending;
+        // Moves or, while a clone shares the block, copies the lines of
+        // block b from `at` up to `to` to the end of pending.
+        auto take = [&](size_t to) {
+            auto& lines = blocks[b]->lines;
+            if (blocks[b].use_count() == 1) {
+                std::atomic_thread_fence(std::memory_order_acquire);
+                std::move(lines.begin() + at, lines.begin() + to, std::back_inserter(pending));
+            } else {
+                pending.insert(pending.end(), lines.begin() + at, lines.begin() + to);
+            }
+            at = to;
+            if (at == lines.size()) b++, at = 0;
+        };
+        for (auto& run : runs) {
+            while (rowsBefore(b) + at < run.row) {
+                if (at > 0 || rows[b] > run.row) {
+                    take(std::min(blocks[b]->lines.size(), run.row - rowsBefore(b)));
+                } else if (pending.empty() || pending.size() >= BlockLines / 2) {
+                    cut(pending, result);
+                    result.push_back(blocks[b++]);
+                } else {
+                    take(blocks[b]->lines.size());
+                }
+            }
+            for (auto& text : run.lines) pending.push_back(make(std::move(text)));
+            for (size_t skip = run.count; skip > 0;) {
+                size_t n = std::min(skip, blocks[b]->lines.size() - at);
+                at += n;
+                skip -= n;
+                if (at == blocks[b]->lines.size()) b++, at = 0;
+            }
+        }
+        if (at > 0) take(blocks[b]->lines.size());
+        if (pending.size() < BlockLines / 2 && b < blocks.size()) take(blocks[b]->lines.size());
+        cut(pending, result);
+        blocks.erase(blocks.begin() + first, blocks.begin() + b);
+        blocks.insert(blocks.begin() + first, result.begin(), result.end());
+        recount(first);
+    }
+
+public:
+    void assign(std::vector<Line> lines) {
+        blocks.clear();
+        cut(lines, blocks);
+        recount(0);
+    }
+
+    size_t size() const { return rows.back(); }
+
+    const Line& operator[](size_t row) const {
+        size_t within, b = locate(row, within);
+        return blocks[b]->lines[within];
+    }
+
+    size_t offsetOf(size_t row) const {
+        size_t within, b = locate(row, within);
+        if (b == blocks.size()) return bytes.back();
+        return bytesBefore(b) + blocks[b]->index.offsetOf(within);
+    }
+
+    size_t rowAt(size_t offset) const {
+        size_t b = std::upper_bound(bytes.begin(), bytes.end(), offset) - bytes.begin();
+        if (b == blocks.size()) return size() - 1;
+        return rowsBefore(b) + blocks[b]->index.rowAt(offset - bytesBefore(b));
+    }
+
+    // Lets `change` alter line `row` in place and adjusts the totals after
+    // its block.
+    template <typename Change>
+    void modify(size_t row, Change change) {
+        size_t within, b = locate(row, within);
+        Block& block = writable(b);
+        size_t length = block.lines[within].size();
+        change(block.lines[within]);
+        size_t now = block.lines[within].size();
+        block.index.resize(within, length, now);
+        for (; b < bytes.size(); b++) bytes[b] += now - length;
+    }
+
+    // Replaces the lines of each run with `make` of its new text. Touched
+    // lines are rewritten once each; if the line count changes the blocks
+    // they are in are rebuilt in one pass instead of shifted once per run.
+    template <typename Make>
+    void rewrite(std::vector<LineRewrite>& runs, Make make) {
+        if (runs.empty()) return;
+        if (!keepsLineCount(runs)) {
+            splice(runs, make);
+            return;
+        }
+        size_t within, first = locate(runs.front().row, within);
+        for (auto& run : runs) {
+            for (size_t i = 0; i < run.count; i++) {
+                size_t b = locate(run.row + i, within);
+                Block& block = writable(b);
+                size_t length = block.lines[within].size();
+                block.lines[within] = make(std::move(run.lines[i]));
+                block.index.resize(within, length, block.lines[within].size());
+            }
+        }
+        recount(first);
+    }
+
+    template <typename Visit>
+    void forEach(Visit visit) const {
+        for (const auto& block : blocks) {
+            for (const auto& line : block->lines) visit(line);
+        }
+    }
+
+    // Blocks are counted in full even while a clone shares them.
+    size_t lineMemory() const {
+        size_t total = heapBytes(blocks);
+        for (const auto& block : blocks) total += sizeof(Block) + heapBytes(block->lines);
+        return total;
+    }
+
+    size_t indexMemory() const {
+        size_t total = heapBytes(rows) + heapBytes(bytes);
+        for (const auto& block : blocks) total += block->index.memoryUsage();
+        return total;
+    }
+};
+
+class LineStorage : public TextStorage {
+    BlockedLines<std::string> lines;
+
+public:
+    LineStorage() { assign(""); }
+    std::unique_ptr<TextStorage> clone() const override { return std::make_unique<LineStorage>(*this); }
+
+    void assign(std::string text) override { lines.assign(splitLines(text, indexThreads)); }
+
+    size_t lineCount() const override { return lines.size(); }
+    size_t lineLength(size_t row) const override { return lines[row].size(); }
+    std::string line(size_t row) const override { return lines[row]; }
+    size_t offsetOf(size_t row) const override { return lines.offsetOf(row); }
+    size_t rowAt(size_t offset) const override { return lines.rowAt(offset); }
+    size_t textMemory() const override { return lines.lineMemory(); }
+    size_t indexMemory() const override { return lines.indexMemory(); }
+
+    std::string_view lineView(size_t row, size_t col, size_t len, std::string&) const override {
+        const std::string& text = lines[row];
+        return col < text.size() ? std::string_view(text).substr(col, len) : std::string_view();
+    }
+
+    void insert(size_t row, size_t col, const std::string& text) override {
+        if (text.find('\n') == std::string::npos) {
+            lines.modify(row, [&](std::string& line) { line.insert(col, text); });
+            return;
+        }
+        std::vector<LineRewrite> runs{{row, 1, {lines[row]}}};
+        insertIntoLines(runs[0].lines, 0, col, text);
+        lines.rewrite(runs, [](std::string text) { return text; });
+    }
+
+    void erase(size_t row, size_t col, size_t len) override {
+        size_t endRow = row, endCol = col + len;
+        while (endCol > lineLength(endRow) && endRow + 1 < lineCount()) {
+            endCol -= lineLength(endRow) + 1;
+            endRow++;
+        }
+        if (endRow == row) {
+            lines.modify(row, [&](std::string& line) { line.erase(col, len); });
+            return;
+        }
+        const std::string& last = lines[endRow];
+        std::string joined = lines[row].substr(0, col);
+        joined.append(last, std::min(endCol, last.size()), std::string::npos);
+        std::vector<LineRewrite> runs{{row, endRow - row + 1, {std::move(joined)}}};
+        lines.rewrite(runs, [](std::string text) { return text; });
+    }
+
+    // Only the last block is rebuilt, so the cost is that of the text.
+    void append(const std::string& text) override {
+        size_t row = lineCount() - 1;
+        insert(row, lineLength(row), text);
+    }
+
+    std::vector<std::string> apply(const std::vector<Edit>& edits) override {
+        std::vector<std::string> removed;
+        auto runs = lineRewrites(*this, edits, removed);
+        lines.rewrite(runs, [](std::string text) { return text; });
+        return removed;
+    }
+
+    void writeTo(TextSink& sink) const override {
+        lines.forEach([&](const std::string& line) {
+            sink.write(line.data(), line.size());
+            sink.write("\n", 1);
+        });
+    }
+};
+
+// Lines as 16-byte references into one immutable arena holding the loaded
+// text, so loading costs one allocation instead of one per line. A line is
+// promoted to its own string the first time it is edited; the arena bytes
+// it used to refer to are simply left unused. The references sit in the
+// same blocks as LineStorage's lines, so adding a line rebuilds one block
+// and its index rather than the whole vector.
+//
+// With interning, the arena holds each distinct line once, followed by its
+// newline, and identical lines all refer to that copy. Editing one of them
+// promotes just that line, like any other edit.
+class ArenaStorage : public TextStorage {
+    static constexpr size_t Edited = size_t(1) << 63;
+
+    struct Line {
+        size_t where = Edited;  // arena offset, or Edited | slot in `edited`
+        size_t length = 0;
+        size_t size() const { return length; }
+    };
+
+    std::shared_ptr<const std::string> arena = std::make_shared<std::string>();
+    BlockedLines<Line> lines;
+    std::vector<std::string> edited;
+    std::vector<size_t> freeSlots;
+    bool intern = false;
+    size_t referenced = 0;  // bytes of arena lines in use, newlines included
+
+    const char* data(const Line& l) const {
+        return l.where & Edited ? edited[l.where & ~Edited].data() : arena->data() + l.where;
+    }
+
+    Line promote(std::string text) {
+        size_t slot = edited.size();
+        if (freeSlots.empty()) {
+            edited.push_back(std::move(text));
+        } else {
+            slot = freeSlots.back();
+            freeSlots.pop_back();
+            edited[slot] = std::move(text);
+        }
+        return Line{Edited | slot, edited[slot].size()};
+    }
+
+    // Rewrites line references to a new arena holding each distinct line
+    // of `text` once, and returns that arena.
+    static std::string internLines(const std::string& text, std::vector<Line>& lines) {
+        std::unordered_map<std::string_view, size_t> seen;
+        std::string unique;
+        for (auto& l : lines) {
+            std::string_view view(text.data() + l.where, l.length);
+            auto [it, added] = seen.emplace(view, unique.size());
+            if (added) {
+                unique.append(view);
+                unique += '\n';
+            }
+            l.where = it->second;
+        }
+        unique.shrink_to_fit();
+        return unique;
+    }
+
+    // Gives up the bytes `row` refers to, ahead of it being replaced.
+    void release(size_t row) {
+        const Line& l = lines[row];
+        if (!(l.where & Edited)) {
+            referenced -= l.length + 1;
+            return;
+        }
+        size_t slot = l.where & ~Edited;
+        edited[slot] = std::string();
+        freeSlots.push_back(slot);
+    }
+
+    // Replaces the lines of each run with owned copies of its text.
+    void replaceLines(std::vector<LineRewrite>& runs) {
+        for (const auto& run : runs) {
+            for (size_t r = run.row; r < run.row + run.count; r++) release(r);
+        }
+        lines.rewrite(runs, [this](std::string text) { return promote(std::move(text)); });
+    }
+
+public:
+    explicit ArenaStorage(bool intern = false) : intern(intern) { lines.assign({Line{0, 0}}); }
+    std::unique_ptr<TextStorage> clone() const override { return std::make_unique<ArenaStorage>(*this); }
+
+    void assign(std::string text) override {
+        std::vector<size_t> breaks;
+        indexNewlines(text.data(), text.size(), 0, breaks, indexThreads);
+        std::vector<Line> refs;
+        refs.reserve(breaks.size() + 1);
+        size_t start = 0;
+        for (size_t nl : breaks) {
+            refs.push_back(Line{start, nl - start});
+            start = nl + 1;
+        }
+        refs.push_back(Line{start, text.size() - start});
+        referenced = text.size() + 1;
+        if (intern) text = internLines(text, refs);
+        arena = std::make_shared<const std::string>(std::move(text));
+        edited.clear();
+        freeSlots.clear();
+        lines.assign(std::move(refs));
+    }
+
+    size_t lineCount() const override { return lines.size(); }
+    size_t offsetOf(size_t row) const override { return lines.offsetOf(row); }
+    size_t rowAt(size_t offset) const override { return lines.rowAt(offset); }
+    size_t lineLength(size_t row) const override { return lines[row].length; }
+    std::string line(size_t row) const override { return std::string(data(lines[row]), lines[row].length); }
+
+    std::string_view lineView(size_t row, size_t col, size_t len, std::string&) const override {
+        const Line& l = lines[row];
+        return col < l.length ? std::string_view(data(l) + col, std::min(len, l.length - col)) : std::string_view();
+    }
+    size_t internedBytes() const override { return referenced > arena->size() ? referenced - arena->size() : 0; }
+    // The arena is counted in full even while a clone shares it.
+    size_t textMemory() const override {
+        return arena->capacity() + lines.lineMemory() + heapBytes(edited) + heapBytes(freeSlots);
+    }
+    size_t indexMemory() const override { return lines.indexMemory(); }
+
+    void insert(size_t row, size_t col, const std::string& text) override {
+        if (text.empty()) return;
+        std::vector<LineRewrite> runs{{row, 1, {line(row)}}};
+        insertIntoLines(runs[0].lines, 0, col, text);
+        replaceLines(runs);
+    }
+
+    // The arena is shared with clones and never grows, so appended lines
+    // are promoted like edited ones; only the last block is rebuilt.
+    void append(const std::string& text) override {
+        size_t row = lines.size() - 1;
+        insert(row, lines[row].length, text);
+    }
+
+    void erase(size_t row, size_t col, size_t len) override {
+        size_t endRow = row, endCol = col + len;
+        while (endCol > lines[endRow].length && endRow + 1 < lines.size()) {
+            endCol -= lines[endRow].length + 1;
+            endRow++;
+        }
+        std::vector<LineRewrite> runs{{row, endRow - row + 1, {}}};
+        for (size_t r = row; r <= endRow; r++) runs[0].lines.push_back(line(r));
+        eraseFromLines(runs[0].lines, 0, col, len);
+        replaceLines(runs);
+    }
+
+    // Spans runs of untouched lines that are adjacent in the arena, up to
+    // MaxChunk so that a short read does not walk the whole run.
+    std::string_view chunkAt(size_t offset, std::string& scratch) const override {
+        constexpr size_t MaxChunk = 1 << 20;
+        if (offset >= size()) return {};
+        size_t row = rowAt(offset);
+        size_t col = offset - lines.offsetOf(row);
+        if (lines[row].where & Edited) return TextStorage::chunkAt(offset, scratch);
+        size_t start = lines[row].where + col, end = lines[row].where + lines[row].length;
+        for (; row + 1 < lines.size() && end < arena->size() && end - start < MaxChunk; row++) {
+            end++;  // the arena holds the newline after every line but its last
+            const Line& next = lines[row + 1];
+            if (next.where != end) break;
+            end += next.length;
+        }
+        if (start == end) return TextStorage::chunkAt(offset, scratch);
+        return std::string_view(arena->data() + start, end - start);
+    }
+
+    std::vector<std::string> apply(const std::vector<Edit>& edits) override {
+        std::vector<std::string> removed;
+        auto runs = lineRewrites(*this, edits, removed);
+        replaceLines(runs);
+        return removed;
+    }
+
+    // Runs of untouched lines that are still adjacent in the arena go out
+    // as a single span, newlines included.
+    void writeTo(TextSink& sink) const override {
+        size_t start = 0, end = 0;  // the span not yet written
+        auto flush = [&] {
+            if (start == end) return;
+            sink.write(arena->data() + start, std::min(end, arena->size()) - start);
+            if (end > arena->size()) sink.write("\n", 1);
+            start = end;
+        };
+        lines.forEach([&](const Line& l) {
+            if (l.where & Edited) {
+                flush();
+                sink.write(data(l), l.length);
+                sink.write("\n", 1);
+                return;
+            }
+            if (l.where != end) {
+                flush();
+                start = l.where;
+            }
+            end = l.where + l.length + 1;
+        });
+        flush();
+    }
+};
+
+// Classic piece table: the loaded text is never modified, inserted text is
+// appended to an add buffer, and the document is the concatenation of the
+// pieces. Each buffer keeps a sorted index of its '\n' offsets, and the
+// piece list keeps running byte and newline totals, so locating an offset
+// or a line is a binary search over the pieces and then over one buffer's
+// newlines. An edit rewrites the totals from the first piece it changes,
+// which costs no more than the piece list insert or erase it goes with.
+//
+// Buffers are shared between clones. The add buffer is a list of segments
+// and text only goes into the last one while no clone refers to it; once a
+// clone does, that segment is capped at its current length and the next
+// insert starts a new one. A clone therefore copies the piece list and the
+// segment pointers but no text.
+class PieceTableStorage : public TextStorage {
+    struct Segment {
+        std::string text;
+        std::vector<size_t> breaks;
+    };
+
+    struct Piece {
+        size_t source;  // index into `sources`; 0 is the loaded text
+        size_t start, length, newlines;
+    };
+
+    std::vector<std::shared_ptr<Segment>> sources{std::make_shared<Segment>()};
+    std::vector<Piece> pieces;
+    // ends[i] and rows[i] are the bytes and newlines in pieces 0..i.
+    std::vector<size_t> ends, rows;
+    size_t totalLength = 0, totalNewlines = 0;
+
+    const std::string& source(const Piece& p) const { return sources[p.source]->text; }
+    const std::vector<size_t>& breaks(const Piece& p) const { return sources[p.source]->breaks; }
+
+    size_t countNewlines(const Piece& p) const {
+        const auto& b = breaks(p);
+        return std::lower_bound(b.begin(), b.end(), p.start + p.length) -
+               std::lower_bound(b.begin(), b.end(), p.start);
+    }
+
+    size_t startOf(size_t i) const { return i > 0 ? ends[i - 1] : 0; }
+    size_t rowsBefore(size_t i) const { return i > 0 ? rows[i - 1] : 0; }
+
+    // The piece holding `offset`, or pieces.size() past the end.
+    size_t pieceAt(size_t offset) const {
+        return std::upper_bound(ends.begin(), ends.end(), offset) - ends.begin();
+    }
+
+    // Brings the running totals up to date from piece `first` on.
+    void recount(size_t first) {
+        ends.resize(pieces.size());
+        rows.resize(pieces.size());
+        for (size_t i = first; i < pieces.size(); i++) {
+            ends[i] = startOf(i) + pieces[i].length;
+            rows[i] = rowsBefore(i) + pieces[i].newlines;
+        }
+        totalLength = pieces.empty() ? 0 : ends.back();
+        totalNewlines = pieces.empty() ? 0 : rows.back();
+    }
+
+    size_t lineStart(size_t row) const {
+        if (row == 0) return 0;
+        size_t i = std::lower_bound(rows.begin(), rows.end(), row) - rows.begin();
+        if (i == pieces.size()) return totalLength;
+        const Piece& p = pieces[i];
+        const auto& b = breaks(p);
+        size_t first = std::lower_bound(b.begin(), b.end(), p.start) - b.begin();
+        return startOf(i) + b[first + (row - rowsBefore(i) - 1)] - p.start + 1;
+    }
+
+    // Ensures a piece boundary falls on `offset` and returns the index of
+    // the piece that starts there.
+    size_t splitAt(size_t offset) {
+        size_t i = pieceAt(offset);
+        if (i == pieces.size() || offset == startOf(i)) return i;
+        Piece& p = pieces[i];
+        size_t head = offset - startOf(i);
+        Piece tail{p.source, p.start + head, p.length - head, 0};
+        p.length = head;
+        p.newlines = countNewlines(p);
+        tail.newlines = countNewlines(tail);
+        pieces.insert(pieces.begin() + i + 1, tail);
+        recount(i);
+        return i + 1;
+    }
+
+    // Copies `text` to the end of the add buffer and returns a piece for it.
+    Piece add(const std::string& text) {
+        if (sources.size() == 1 || sources.back().use_count() > 1) sources.push_back(std::make_shared<Segment>());
+        else std::atomic_thread_fence(std::memory_order_acquire);
+        Segment& segment = *sources.back();
+        size_t start = segment.text.size(), indexed = segment.breaks.size();
+        indexNewlines(text.data(), text.size(), start, segment.breaks);
+        segment.text += text;
+        return Piece{sources.size() - 1, start, text.size(), segment.breaks.size() - indexed};
+    }
+
+    // Adds `piece` to the end of `list`, extending the last piece instead
+    // when that one ends where `piece` starts in the same segment.
+    static void extend(std::vector<Piece>& list, const Piece& piece) {
+        if (!list.empty()) {
+            Piece& last = list.back();
+            if (last.source == piece.source && last.start + last.length == piece.start) {
+                last.length += piece.length;
+                last.newlines += piece.newlines;
+                return;
+            }
+        }
+        list.push_back(piece);
+    }
+
+    // Puts `piece` before piece `i`, or extends the piece before it when
+    // that one ends where `piece` starts in the same segment.
+    void place(size_t i, const Piece& piece) {
+        const Piece* before = i > 0 ? &pieces[i - 1] : nullptr;
+        if (before && before->source == piece.source && before->start + before->length == piece.start) {
+            pieces[i - 1].length += piece.length;
+            pieces[i - 1].newlines += piece.newlines;
+            recount(i - 1);
+            return;
+        }
+        pieces.insert(pieces.begin() + i, piece);
+        recount(i);
+    }
+
+    void append(size_t offset, size_t len, std::string& out) const {
+        for (size_t i = pieceAt(offset); i < pieces.size() && len > 0; i++) {
+            const Piece& p = pieces[i];
+            size_t skip = offset > startOf(i) ? offset - startOf(i) : 0;
+            size_t take = std::min(p.length - skip, len);
+            out.append(source(p), p.start + skip, take);
+            len -= take;
+        }
+    }
+
+public:
+    std::unique_ptr<TextStorage> clone() const override { return std::make_unique<PieceTableStorage>(*this); }
+
+    void assign(std::string text) override {
+        auto original = std::make_shared<Segment>();
+        indexNewlines(text.data(), text.size(), 0, original->breaks, indexThreads);
+        original->text = std::move(text);
+        sources.assign(1, original);
+        pieces.clear();
+        if (!original->text.empty()) pieces.push_back({0, 0, original->text.size(), original->breaks.size()});
+        recount(0);
+    }
+
+    size_t lineCount() const override { return totalNewlines + 1; }
+    size_t offsetOf(size_t row) const override { return lineStart(row); }
+
+    size_t rowAt(size_t offset) const override {
+        size_t i = pieceAt(offset);
+        if (i == pieces.size()) return totalNewlines;
+        const Piece& p = pieces[i];
+        const auto& b = breaks(p);
+        return rowsBefore(i) + (std::lower_bound(b.begin(), b.end(), p.start + offset - startOf(i)) -
+                                std::lower_bound(b.begin(), b.end(), p.start));
+    }
+
+    // Segments are counted in full even while a clone shares them.
+    size_t textMemory() const override {
+        size_t bytes = heapBytes(pieces) + heapBytes(sources);
+        for (const auto& segment : sources) bytes += sizeof(Segment) + heapBytes(segment->text);
+        return bytes;
+    }
+
+    size_t indexMemory() const override {
+        size_t bytes = heapBytes(ends) + heapBytes(rows);
+        for (const auto& segment : sources) bytes += heapBytes(segment->breaks);
+        return bytes;
+    }
+
+    size_t lineLength(size_t row) const override {
+        size_t end = row + 1 < lineCount() ? lineStart(row + 1) - 1 : totalLength;
+        return end - lineStart(row);
+    }
+
+    std::string line(size_t row) const override {
+        size_t start = lineStart(row);
+        size_t end = row + 1 < lineCount() ? lineStart(row + 1) - 1 : totalLength;
+        std::string result;
+        result.reserve(end - start);
+        append(start, end - start, result);
+        return result;
+    }
+
+    std::string_view lineView(size_t row, size_t col, size_t len, std::string& scratch) const override {
+        size_t start = lineStart(row);
+        size_t end = row + 1 < lineCount() ? lineStart(row + 1) - 1 : totalLength;
+        if (col >= end - start) return {};
+        size_t offset = start + col, i = pieceAt(offset);
+        len = std::min(len, end - offset);
+        if (i < pieces.size()) {
+            const Piece& p = pieces[i];
+            size_t skip = offset - startOf(i);
+            if (len <= p.length - skip) return std::string_view(source(p)).substr(p.start + skip, len);
+        }
+        scratch.clear();
+        append(offset, len, scratch);
+        return scratch;
+    }
+
+    void insert(size_t row, size_t col, const std::string& text) override {
+        if (text.empty()) return;
+        size_t offset = lineStart(row) + col;
+        Piece piece = add(text);
+        place(splitAt(offset), piece);
+    }
+
+    void append(const std::string& text) override {
+        if (!text.empty()) place(pieces.size(), add(text));
+    }
+
+    void erase(size_t row, size_t col, size_t len) override {
+        size_t offset = lineStart(row) + col;
+        len = std::min(len, totalLength - offset);
+        if (len == 0) return;
+        size_t first = splitAt(offset);
+        size_t last = splitAt(offset + len);
+        pieces.erase(pieces.begin() + first, pieces.begin() + last);
+        recount(first);
+    }
+
+    // One walk over the pieces for the whole batch instead of one per edit:
+    // the text between edits is copied across piece by piece, splitting
+    // where an edit starts or ends, and each edit's text becomes one piece.
+    // Pieces that end up contiguous in the same buffer are joined, so text
+    // typed and then deleted again leaves the list as it was.
+    std::vector<std::string> apply(const std::vector<Edit>& edits) override {
+        std::vector<Piece> result;
+        std::vector<std::string> removed(edits.size());
+        result.reserve(pieces.size() + 2 * edits.size());
+        size_t i = 0, within = 0, at = 0;
+        // Moves up to `to`, keeping the text passed over or else adding it
+        // to `dropped`.
+        auto advance = [&](size_t to, std::string* dropped) {
+            while (at < to && i < pieces.size()) {
+                const Piece& p = pieces[i];
+                size_t take = std::min(p.length - within, to - at);
+                if (dropped) {
+                    dropped->append(source(p), p.start + within, take);
+                } else {
+                    Piece part{p.source, p.start + within, take, p.newlines};
+                    if (take < p.length) part.newlines = countNewlines(part);
+                    extend(result, part);
+                }
+                within += take;
+                at += take;
+                if (within == p.length) {
+                    i++;
+                    within = 0;
+                }
+            }
+        };
+        for (size_t e = 0; e < edits.size(); e++) {
+            const Edit& edit = edits[e];
+            advance(edit.offset, nullptr);
+            advance(edit.offset + edit.length, &removed[e]);
+            if (!edit.text.empty()) extend(result, add(edit.text));
+        }
+        advance(totalLength, nullptr);
+        pieces.swap(result);
+        recount(0);
+        return removed;
+    }
+
+    std::string_view chunkAt(size_t offset, std::string&) const override {
+        size_t i = pieceAt(offset);
+        if (i == pieces.size()) return {};
+        const Piece& p = pieces[i];
+        return std::string_view(source(p)).substr(p.start + offset - startOf(i), ends[i] - offset);
+    }
+
+    std::string_view chunkBefore(size_t offset, std::string&) const override {
+        offset = std::min(offset, totalLength);
+        if (offset == 0) return {};
+        size_t i = pieceAt(offset - 1);
+        const Piece& p = pieces[i];
+        return std::string_view(source(p)).substr(p.start, offset - startOf(i));
+    }
+
+    void writeTo(TextSink& sink) const override {
+        for (const auto& p : pieces) {
+            sink.write(source(p).data() + p.start, p.length);
+        }
+        sink.write("\n", 1);
+    }
+};
+
+// B-tree of text chunks. Every node caches the byte and newline counts of
+// its subtree, so locating a line or offset descends one path from the root
+// and edits only touch the nodes along it. All leaves sit at the same depth.
+// Nodes are immutable once shared: clones share the whole tree, and an edit
+// copies the nodes on its path that another clone still refers to. A clone
+// is therefore O(1) and an edit after one costs O(log n) extra copies.
+class RopeStorage : public TextStorage {
+    static constexpr size_t MaxLeaf = 4096, MinLeaf = MaxLeaf / 4;
+    static constexpr size_t MaxChildren = 32, MinChildren = MaxChildren / 4;
+
+    struct Node;
+    using NodePtr = std::shared_ptr<Node>;
+
+    struct Node {
+        size_t bytes = 0, newlines = 0;
+        std::string text;
+        std::vector<NodePtr> children;
+
+        bool isLeaf() const { return children.empty(); }
+        bool underfull() const { return isLeaf() ? text.size() < MinLeaf : children.size() < MinChildren; }
+
+        void recount() {
+            if (isLeaf()) {
+                bytes = text.size();
+                newlines = std::count(text.begin(), text.end(), '\n');
+                return;
+            }
+            bytes = newlines = 0;
+            for (const auto& c : children) {
+                bytes += c->bytes;
+                newlines += c->newlines;
+            }
+        }
+    };
+
+    NodePtr root = std::make_shared<Node>();
+
+    // Nodes shared with clones are counted as if they were not.
+    static size_t nodeBytes(const Node& n) {
+        size_t bytes = sizeof(Node) + heapBytes(n.text) + heapBytes(n.children);
+        for (const auto& c : n.children) bytes += nodeBytes(*c);
+        return bytes;
+    }
+
+    static NodePtr makeLeaf(std::string text) {
+        auto leaf = std::make_shared<Node>();
+        leaf->text = std::move(text);
+        leaf->recount();
+        return leaf;
+    }
+
+    static NodePtr makeParent(std::vector<NodePtr>::iterator first, std::vector<NodePtr>::iterator last) {
+        auto parent = std::make_shared<Node>();
+        parent->children.assign(first, last);
+        parent->recount();
+        return parent;
+    }
+
+    // Splits an oversized node into evenly filled siblings. The node keeps
+    // the first share; the rest are returned in order.
+    static std::vector<NodePtr> split(Node& n) {
+        std::vector<NodePtr> extra;
+        if (n.isLeaf()) {
+            if (n.text.size() <= MaxLeaf) return extra;
+            size_t parts = (n.text.size() + MaxLeaf - 1) / MaxLeaf;
+            size_t share = (n.text.size() + parts - 1) / parts;
+            for (size_t pos = share; pos < n.text.size(); pos += share) {
+                extra.push_back(makeLeaf(n.text.substr(pos, share)));
+            }
+            n.text.resize(share);
+            n.text.shrink_to_fit();
+        } else {
+            if (n.children.size() <= MaxChildren) return extra;
+            size_t parts = (n.children.size() + MaxChildren - 1) / MaxChildren;
+            size_t share = (n.children.size() + parts - 1) / parts;
+            for (size_t pos = share; pos < n.children.size(); pos += share) {
+                auto last = n.children.begin() + std::min(pos + share, n.children.size());
+                extra.push_back(makeParent(n.children.begin() + pos, last));
+            }
+            n.children.resize(share);
+        }
+        n.recount();
+        return extra;
+    }
+
+    void growRoot(std::vector<NodePtr> extra) {
+        if (extra.empty()) return;
+        extra.insert(extra.begin(), root);
+        while (extra.size() > 1) {
+            std::vector<NodePtr> level;
+            for (size_t pos = 0; pos < extra.size(); pos += MaxChildren) {
+                auto last = extra.begin() + std::min(pos + MaxChildren, extra.size());
+                level.push_back(makeParent(extra.begin() + pos, last));
+            }
+            extra = std::move(level);
+        }
+        root = extra.front();
+    }
+
+    // Makes `n` safe to modify, copying it if another tree shares it. The
+    // copy shares all children, so callers own each node on their way down.
+    static Node& own(NodePtr& n) {
+        if (n.use_count() > 1) n = std::make_shared<Node>(*n);
+        else std::atomic_thread_fence(std::memory_order_acquire);
+        return *n;
+    }
+
+    void shrinkRoot() {
+        while (!root->isLeaf() && root->children.size() == 1) root = root->children.front();
+        if (!root->isLeaf() && root->children.empty()) root = std::make_shared<Node>();
+    }
+
+    size_t lineStart(size_t row) const {
+        if (row == 0) return 0;
+        size_t offset = 0;
+        const Node* n = root.get();
+        while (!n->isLeaf()) {
+            for (const auto& c : n->children) {
+                if (c->newlines >= row) {
+                    n = c.get();
+                    break;
+                }
+                row -= c->newlines;
+                offset += c->bytes;
+            }
+        }
+        size_t pos = 0;
+        for (; row > 0; row--) pos = n->text.find('\n', pos) + 1;
+        return offset + pos;
+    }
+
+    size_t lineEnd(size_t row) const {
+        return row + 1 < lineCount() ? lineStart(row + 1) - 1 : root->bytes;
+    }
+
+    // The leaf holding byte `offset`, which becomes the offset within it.
+    const Node* leafAt(size_t& offset) const {
+        const Node* n = root.get();
+        while (!n->isLeaf()) {
+            for (const auto& c : n->children) {
+                if (offset < c->bytes) {
+                    n = c.get();
+                    break;
+                }
+                offset -= c->bytes;
+            }
+        }
+        return n;
+    }
+
+    static void collect(const Node& n, size_t offset, size_t len, std::string& out) {
+        if (n.isLeaf()) {
+            out.append(n.text, offset, len);
+            return;
+        }
+        for (const auto& c : n.children) {
+            if (len == 0) return;
+            if (offset >= c->bytes) {
+                offset -= c->bytes;
+                continue;
+            }
+            size_t take = std::min(len, c->bytes - offset);
+            collect(*c, offset, take, out);
+            len -= take;
+            offset = 0;
+        }
+    }
+
+    static std::vector<NodePtr> insertAt(Node& n, size_t offset, const std::string& text) {
+        if (n.isLeaf()) {
+            n.text.insert(offset, text);
+            n.bytes += text.size();
+            n.newlines += std::count(text.begin(), text.end(), '\n');
+            return split(n);
+        }
+        size_t i = 0;
+        while (i + 1 < n.children.size() && offset > n.children[i]->bytes) {
+            offset -= n.children[i]->bytes;
+            i++;
+        }
+        auto extra = insertAt(own(n.children[i]), offset, text);
+        n.children.insert(n.children.begin() + i + 1, extra.begin(), extra.end());
+        n.recount();
+        return split(n);
+    }
+
+    // Merges an underfull child into a neighbour, re-splitting if the
+    // result overflows. Returns true if the child count dropped.
+    static bool rebalance(Node& n, size_t i) {
+        if (n.children.size() < 2 || !n.children[i]->underfull()) return false;
+        size_t left = i + 1 < n.children.size() ? i : i - 1;
+        Node& a = own(n.children[left]);
+        Node& b = *n.children[left + 1];
+        if (a.isLeaf()) a.text += b.text;
+        else a.children.insert(a.children.end(), b.children.begin(), b.children.end());
+        n.children.erase(n.children.begin() + left + 1);
+        a.recount();
+        auto extra = split(a);
+        n.children.insert(n.children.begin() + left + 1, extra.begin(), extra.end());
+        return extra.empty();
+    }
+
+    static void eraseRange(Node& n, size_t offset, size_t len) {
+        if (n.isLeaf()) {
+            auto first = n.text.begin() + offset;
+            n.newlines -= std::count(first, first + len, '\n');
+            n.text.erase(offset, len);
+            n.bytes = n.text.size();
+            return;
+        }
+        for (size_t i = 0; i < n.children.size() && len > 0;) {
+            Node& c = *n.children[i];
+            if (offset >= c.bytes) {
+                offset -= c.bytes;
+                i++;
+                continue;
+            }
+            size_t take = std::min(len, c.bytes - offset);
+            len -= take;
+            if (take == c.bytes) {
+                n.children.erase(n.children.begin() + i);
+                continue;
+            }
+            eraseRange(own(n.children[i]), offset, take);
+            offset = 0;
+            i++;
+        }
+        for (size_t i = 0; i < n.children.size();) {
+            if (rebalance(n, i)) i = std::min(i, n.children.size() - 1);
+            else i++;
+        }
+        n.recount();
+    }
+
+public:
+    std::unique_ptr<TextStorage> clone() const override { return std::make_unique<RopeStorage>(*this); }
+
+    void assign(std::string text) override {
+        std::vector<NodePtr> leaves;
+        for (size_t pos = 0; pos < text.size(); pos += MaxLeaf) {
+            leaves.push_back(makeLeaf(text.substr(pos, MaxLeaf)));
+        }
+        text.clear();
+        text.shrink_to_fit();
+        root = std::make_shared<Node>();
+        if (leaves.empty()) return;
+        root = leaves.front();
+        growRoot(std::vector<NodePtr>(leaves.begin() + 1, leaves.end()));
+    }
+
+    size_t lineCount() const override { return root->newlines + 1; }
+    // Byte and newline counts live in the nodes, so there is no separate index.
+    size_t textMemory() const override { return nodeBytes(*root); }
+    size_t indexMemory() const override { return 0; }
+    size_t offsetOf(size_t row) const override { return lineStart(row); }
+    size_t lineLength(size_t row) const override { return lineEnd(row) - lineStart(row); }
+
+    size_t rowAt(size_t offset) const override {
+        size_t row = 0;
+        const Node* n = root.get();
+        while (!n->isLeaf()) {
+            const Node* next = nullptr;
+            for (const auto& c : n->children) {
+                if (offset < c->bytes) {
+                    next = c.get();
+                    break;
+                }
+                offset -= c->bytes;
+                row += c->newlines;
+            }
+            if (!next) return row;
+            n = next;
+        }
+        return row + std::count(n->text.begin(), n->text.begin() + std::min(offset, n->text.size()), '\n');
+    }
+
+    std::string line(size_t row) const override {
+        size_t start = lineStart(row);
+        std::string result;
+        collect(*root, start, lineEnd(row) - start, result);
+        return result;
+    }
+
+    std::string_view lineView(size_t row, size_t col, size_t len, std::string& scratch) const override {
+        size_t start = lineStart(row), end = lineEnd(row);
+        if (col >= end - start) return {};
+        len = std::min(len, end - start - col);
+        size_t offset = start + col;
+        const Node* n = leafAt(offset);
+        if (offset + len <= n->text.size()) return std::string_view(n->text).substr(offset, len);
+        scratch.clear();
+        collect(*root, start + col, len, scratch);
+        return scratch;
+    }
+
+    void insert(size_t row, size_t col, const std::string& text) override {
+        if (text.empty()) return;
+        growRoot(insertAt(own(root), lineStart(row) + col, text));
+    }
+
+    void erase(size_t row, size_t col, size_t len) override {
+        size_t offset = lineStart(row) + col;
+        len = std::min(len, root->bytes - offset);
+        if (len == 0) return;
+        eraseRange(own(root), offset, len);
+        shrinkRoot();
+    }
+
+    std::string_view chunkAt(size_t offset, std::string&) const override {
+        if (offset >= root->bytes) return {};
+        const Node* leaf = leafAt(offset);
+        return std::string_view(leaf->text).substr(offset);
+    }
+
+    std::string_view chunkBefore(size_t offset, std::string&) const override {
+        offset = std::min(offset, root->bytes);
+        if (offset == 0) return {};
+        size_t last = offset - 1;
+        const Node* leaf = leafAt(last);
+        return std::string_view(leaf->text).substr(0, last + 1);
+    }
+
+    void writeTo(TextSink& sink) const override {
+        std::vector<const Node*> stack{root.get()};
+        while (!stack.empty()) {
+            const Node* n = stack.back();
+            stack.pop_back();
+            if (n->isLeaf()) sink.write(n->text.data(), n->text.size());
+            for (auto it = n->children.rbegin(); it != n->children.rend(); ++it) stack.push_back(it->get());
+        }
+        sink.write("\n", 1);
+    }
+};
+
+// A read-only mapping of a file, or a copy of its text once detached from
+// it. The descriptor stays open so the file's current size can be checked:
+// touching a page past the end of a file that shrank raises SIGBUS.
+class MappedFile {
+    const char* bytes = nullptr;
+    size_t length = 0;
+    int fd = -1;
+    std::string copy;
+public:
+    explicit MappedFile(const std::string& path) {
+        fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) return;
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size > 0) {
+            void* addr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (addr != MAP_FAILED) {
+                bytes = static_cast<const char*>(addr);
+                length = st.st_size;
+            }
+        }
+    }
+    MappedFile() = default;
+    // Holds `text` in memory in place of a file.
+    static std::shared_ptr<const MappedFile> copyOf(std::string text) {
+        auto file = std::make_shared<MappedFile>();
+        file->copy = std::move(text);
+        file->bytes = file->copy.data();
+        file->length = file->copy.size();
+        return file;
+    }
+    ~MappedFile() {
+        if (fd >= 0 && bytes) munmap(const_cast<char*>(bytes), length);
+        if (fd >= 0) close(fd);
+    }
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    const char* data() const { return bytes; }
+    size_t size() const { return length; }
+    bool isMapped() const { return fd >= 0; }
+
+    // Bytes of the mapping the file still holds. Pages past the end of a
+    // file that shrank are replaced with zero pages, so a reader that gets
+    // there first sees zeros instead of dying.
+    size_t guard() const {
+        struct stat st;
+        if (fd < 0 || !bytes || fstat(fd, &st) != 0 || size_t(st.st_size) >= length) return length;
+        size_t page = sysconf(_SC_PAGESIZE);
+        size_t from = (st.st_size + page - 1) / page * page;
+        if (from < length) {
+            mmap(const_cast<char*>(bytes) + from, length - from, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED,
+                 -1, 0);
+        }
+        return st.st_size;
+    }
+
+    // True once no path names the file any more, as after another program
+    // replaced it by rename: nothing can change it then.
+    bool unlinked() const {
+        struct stat st;
+        return fd >= 0 && fstat(fd, &st) == 0 && st.st_nlink == 0;
+    }
+};
+
+// Lines of an immutable original text plus an overlay of edits. The
+// document is a list of line runs: untouched runs refer to original lines,
+// edited runs own their lines. Subclasses index the original lazily; the
+// last original run is "open" and grows as that index advances, up to the
+// end of the original or, once text has been appended, to the line that
+// starts at `stop`.
+class OverlayStorage : public TextStorage {
+protected:
+    struct Piece {
+        size_t first = 0, count = 0;
+        bool open = false;
+        std::vector<std::string> lines;
+        size_t stop = SIZE_MAX;
+        bool owned() const { return !lines.empty(); }
+    };
+
+    std::vector<Piece> pieces{Piece{0, 0, false, {""}}};
+
+    // Extends the original index until at least `lines` line starts are
+    // known or the whole original has been scanned.
+    virtual void indexUntil(size_t lines) const = 0;
+    virtual size_t indexedLines() const = 0;
+    virtual size_t originalLength(size_t i) const = 0;
+    virtual std::string originalLine(size_t i) const = 0;
+    // Like lineView, for a line of the original.
+    virtual std::string_view originalView(size_t i, size_t col, size_t len, std::string& scratch) const = 0;
+    virtual size_t originalOffset(size_t i) const = 0;
+    // The original line holding byte `pos` of the original, or the last
+    // one, indexing no further than needed to tell.
+    virtual size_t originalRowAt(size_t pos) const = 0;
+    // Length of the original text, known without indexing it.
+    virtual size_t originalEnd() const = 0;
+    // Writes original bytes [begin, end).
+    virtual void writeOriginal(TextSink& sink, size_t begin, size_t end) const = 0;
+    // A contiguous run of original bytes [begin, end): all of them, or as
+    // many as one read gives from `begin`, or up to `end` with `fromEnd`.
+    virtual std::string_view originalSpan(size_t begin, size_t end, bool fromEnd, std::string& scratch) const = 0;
+
+    static constexpr size_t MaxChunk = 1 << 20;
+
+    // Bytes of original piece `p`, newlines included. An open piece runs
+    // to the end of the original or to its stop.
+    size_t originalBytes(const Piece& p) const {
+        if (p.open) {
+            size_t start = originalOffset(p.first), end = std::min(p.stop, originalEnd() + 1);
+            return end > start ? end - start : 0;
+        }
+        if (p.count == 0) return 0;
+        size_t last = p.first + p.count - 1;
+        return originalOffset(last) + originalLength(last) + 1 - originalOffset(p.first);
+    }
+
+    size_t pieceBytes(const Piece& p) const {
+        if (!p.owned()) return originalBytes(p);
+        size_t bytes = 0;
+        for (const auto& line : p.lines) bytes += line.size() + 1;
+        return bytes;
+    }
+
+    // The piece holding byte `offset`, which is made relative to it, and
+    // its length in `bytes`; pieces.size() past the end. Lengths need no
+    // line count, so an open piece is not indexed to be skipped.
+    size_t pieceAt(size_t& offset, size_t& bytes) const {
+        for (size_t i = 0; i < pieces.size(); i++) {
+            bytes = pieceBytes(pieces[i]);
+            if (offset < bytes) return i;
+            offset -= bytes;
+        }
+        return pieces.size();
+    }
+
+    // Bytes [from, to) of owned piece `p`, a view into a line when they lie
+    // within one and joined in `scratch` otherwise.
+    static std::string_view ownedSpan(const Piece& p, size_t from, size_t to, std::string& scratch) {
+        scratch.clear();
+        size_t start = 0;
+        for (const auto& line : p.lines) {
+            if (start >= to) break;
+            size_t end = start + line.size() + 1;
+            if (end > from) {
+                size_t a = std::max(from, start) - start, b = std::min(to, end) - start;
+                if (scratch.empty() && b <= line.size()) return std::string_view(line).substr(a, b - a);
+                scratch.append(line, a, b - a);
+                if (b > line.size()) scratch += '\n';
+            }
+            start = end;
+        }
+        return scratch;
+    }
+
+    void openOriginal() { pieces.assign(1, Piece{0, 0, true, {}}); }
+
+    size_t count(const Piece& p) const {
+        if (p.owned()) return p.lines.size();
+        if (!p.open) return p.count;
+        size_t n = indexedLines();
+        if (p.stop != SIZE_MAX && n > p.first && originalOffset(n - 1) >= p.stop) n--;
+        return n - p.first;
+    }
+
+    // Hands the last line of the open piece, which is the last piece, to
+    // an owned piece after it. The line is found by scanning back from the
+    // end of the original, so the lines before it need not be counted.
+    void ownLastOriginalLine() {
+        size_t start = originalOffset(pieces.back().first), end = originalEnd(), lineStart = start;
+        std::string scratch, last;
+        for (size_t pos = end; pos > start;) {
+            std::string_view span = originalSpan(start, pos, true, scratch);
+            if (span.empty()) break;
+            size_t newline = span.rfind('\n');
+            if (newline != std::string_view::npos) {
+                lineStart = pos - span.size() + newline + 1;
+                break;
+            }
+            pos -= span.size();
+        }
+        for (size_t pos = lineStart; pos < end;) {
+            std::string_view span = originalSpan(pos, end, false, scratch);
+            if (span.empty()) break;
+            last.append(span);
+            pos += span.size();
+        }
+        if (lineStart == start) {
+            pieces.back() = Piece{0, 0, false, {std::move(last)}};
+        } else {
+            pieces.back().stop = lineStart;
+            pieces.push_back(Piece{0, 0, false, {std::move(last)}});
+        }
+    }
+
+    bool locate(size_t row, size_t& index, size_t& within) const {
+        for (size_t i = 0; i < pieces.size(); i++) {
+            if (pieces[i].open) indexUntil(pieces[i].first + row + 1);
+            size_t n = count(pieces[i]);
+            if (row < n) {
+                index = i;
+                within = row;
+                return true;
+            }
+            row -= n;
+        }
+        return false;
+    }
+
+    // Ensures a piece boundary falls on `row` and returns the index of the
+    // piece that starts there.
+    size_t splitAt(size_t row) {
+        size_t index, within;
+        if (!locate(row, index, within)) return pieces.size();
+        if (within == 0) return index;
+        Piece& p = pieces[index];
+        Piece tail;
+        if (p.owned()) {
+            tail.lines.assign(std::make_move_iterator(p.lines.begin() + within),
+                              std::make_move_iterator(p.lines.end()));
+            p.lines.resize(within);
+        } else {
+            tail.first = p.first + within;
+            tail.count = count(p) - within;
+            tail.open = p.open;
+            tail.stop = p.stop;
+            p.count = within;
+            p.open = false;
+            p.stop = SIZE_MAX;
+        }
+        pieces.insert(pieces.begin() + index + 1, std::move(tail));
+        return index + 1;
+    }
+
+    // Copies rows [row, row + n) out of the original into a single owned
+    // piece, absorbing owned neighbours, and returns that piece's lines.
+    std::vector<std::string>& own(size_t row, size_t n, size_t& within) {
+        size_t first = splitAt(row);
+        size_t last = splitAt(row + n);
+        within = 0;
+        if (first > 0 && pieces[first - 1].owned()) within = count(pieces[--first]);
+        if (last < pieces.size() && pieces[last].owned()) last++;
+
+        Piece merged;
+        for (size_t i = first; i < last; i++) {
+            Piece& p = pieces[i];
+            if (p.owned()) {
+                std::move(p.lines.begin(), p.lines.end(), std::back_inserter(merged.lines));
+            } else {
+                for (size_t j = 0; j < count(p); j++) merged.lines.push_back(originalLine(p.first + j));
+            }
+        }
+        pieces.erase(pieces.begin() + first + 1, pieces.begin() + last);
+        pieces[first] = std::move(merged);
+        return pieces[first].lines;
+    }
+
+public:
+    bool concurrentReads() const override { return false; }
+
+    size_t textMemory() const override {
+        size_t bytes = heapBytes(pieces);
+        for (const auto& p : pieces) bytes += heapBytes(p.lines);
+        return bytes;
+    }
+
+    void assign(std::string text) override {
+        pieces.assign(1, Piece{0, 0, false, splitLines(text, indexThreads)});
+    }
+
+    bool hasLine(size_t row) const override {
+        size_t index, within;
+        return locate(row, index, within);
+    }
+
+    size_t lineCount() const override {
+        indexUntil(SIZE_MAX);
+        size_t n = 0;
+        for (const auto& p : pieces) n += count(p);
+        return n;
+    }
+
+    // The default would count every line of the original first.
+    size_t size() const override {
+        size_t total = 0;
+        for (const auto& p : pieces) {
+            if (!p.owned()) total += originalBytes(p);
+            for (const auto& line : p.lines) total += line.size() + 1;
+        }
+        return total - 1;
+    }
+
+    // One walk over the pieces, indexing the original only as far as the
+    // piece that holds `offset`.
+    size_t rowAt(size_t offset) const override {
+        size_t row = 0;
+        for (size_t i = 0; i < pieces.size(); i++) {
+            const Piece& p = pieces[i];
+            if (p.owned()) {
+                for (const auto& line : p.lines) {
+                    if (offset <= line.size()) return row;
+                    offset -= line.size() + 1;
+                    row++;
+                }
+                continue;
+            }
+            size_t bytes = originalBytes(p);
+            if (bytes == 0) continue;
+            if (offset < bytes || i + 1 == pieces.size()) {
+                return row + originalRowAt(originalOffset(p.first) + std::min(offset, bytes - 1)) - p.first;
+            }
+            offset -= bytes;
+            if (p.open) indexUntil(SIZE_MAX);
+            row += count(p);
+        }
+        return row > 0 ? row - 1 : 0;
+    }
+
+    // Untouched runs come from the original in one span up to the newline
+    // that ends them, owned lines joined up to MaxChunk; the default would
+    // search the pieces again for every line.
+    std::string_view chunkAt(size_t offset, std::string& scratch) const override {
+        size_t bytes = 0, i = pieceAt(offset, bytes);
+        if (i == pieces.size()) return {};
+        size_t end = bytes - (i + 1 == pieces.size());
+        if (offset >= end) return {};
+        const Piece& p = pieces[i];
+        if (p.owned()) return ownedSpan(p, offset, std::min(end, offset + MaxChunk), scratch);
+        if (offset + 1 == bytes) return "\n";
+        size_t start = originalOffset(p.first);
+        return originalSpan(start + offset, start + bytes - 1, false, scratch);
+    }
+
+    std::string_view chunkBefore(size_t offset, std::string& scratch) const override {
+        offset = std::min(offset, size());
+        if (offset == 0) return {};
+        size_t within = offset - 1, bytes = 0, i = pieceAt(within, bytes);
+        const Piece& p = pieces[i];
+        within++;
+        if (p.owned()) return ownedSpan(p, within - std::min(within, MaxChunk), within, scratch);
+        if (within == bytes) return "\n";
+        size_t start = originalOffset(p.first);
+        return originalSpan(start, start + within, true, scratch);
+    }
+
+    size_t offsetOf(size_t row) const override {
+        size_t offset = 0;
+        for (const auto& p : pieces) {
+            if (row == 0) break;
+            if (p.open) indexUntil(p.first + row + 1);
+            size_t take = std::min(row, count(p));
+            if (p.owned()) {
+                for (size_t i = 0; i < take; i++) offset += p.lines[i].size() + 1;
+            } else if (take > 0) {
+                size_t last = p.first + take - 1;
+                offset += originalOffset(last) + originalLength(last) + 1 - originalOffset(p.first);
+            }
+            row -= take;
+        }
+        return offset;
+    }
+
+    size_t lineLength(size_t row) const override {
+        size_t index = 0, within = 0;
+        if (!locate(row, index, within)) return 0;
+        const Piece& p = pieces[index];
+        return p.owned() ? p.lines[within].size() : originalLength(p.first + within);
+    }
+
+    std::string line(size_t row) const override {
+        size_t index = 0, within = 0;
+        if (!locate(row, index, within)) return {};
+        const Piece& p = pieces[index];
+        return p.owned() ? p.lines[within] : originalLine(p.first + within);
+    }
+
+    std::string_view lineView(size_t row, size_t col, size_t len, std::string& scratch) const override {
+        size_t index = 0, within = 0;
+        if (!locate(row, index, within)) return {};
+        const Piece& p = pieces[index];
+        if (!p.owned()) return originalView(p.first + within, col, len, scratch);
+        std::string_view text = p.lines[within];
+        return col < text.size() ? text.substr(col, len) : std::string_view();
+    }
+
+    void insert(size_t row, size_t col, const std::string& text) override {
+        size_t within;
+        auto& lines = own(row, 1, within);
+        insertIntoLines(lines, within, col, text);
+    }
+
+    void erase(size_t row, size_t col, size_t len) override {
+        size_t endRow = row, endCol = col + len;
+        while (endCol > lineLength(endRow) && hasLine(endRow + 1)) {
+            endCol -= lineLength(endRow) + 1;
+            endRow++;
+        }
+        size_t within;
+        auto& lines = own(row, endRow - row + 1, within);
+        eraseFromLines(lines, within, col, len);
+    }
+
+    // One pass over the pieces for the whole batch, which is sorted and
+    // does not overlap. Untouched pieces are carried over whole, original
+    // runs are split where a run of touched lines starts, and each touched
+    // run is rewritten once into an owned piece that absorbs its owned
+    // neighbours, as own() does. Edits are found by byte length, so rows
+    // are only counted inside the pieces they fall in.
+    std::vector<std::string> apply(const std::vector<Edit>& edits) override {
+        std::vector<std::string> removed(edits.size());
+        if (edits.empty()) return removed;
+        std::vector<Piece> result;
+        // The current row is row `w` of piece `i`, which spans document
+        // bytes [pieceStart, pieceEnd); the row starts at `rowStart`.
+        size_t i = 0, w = 0, pieceStart = 0, pieceEnd = 0, rowStart = 0, pos = 0;
+        std::string scratch, text;
+
+        auto enter = [&] {
+            for (; i < pieces.size(); i++) {
+                pieceEnd = pieceStart + pieceBytes(pieces[i]);
+                if (pieceEnd > pieceStart) return;
+            }
+            pieceEnd = SIZE_MAX;
+        };
+        auto emitLine = [&](std::string line) {
+            if (result.empty() || !result.back().owned()) result.emplace_back();
+            result.back().lines.push_back(std::move(line));
+        };
+        // Carries the rows from the current one to the end of its piece
+        // over unchanged and moves to the next piece.
+        auto emitRest = [&] {
+            Piece& p = pieces[i];
+            if (p.owned()) {
+                for (; w < p.lines.size(); w++) emitLine(std::move(p.lines[w]));
+            } else if (p.open) {
+                result.push_back(Piece{p.first + w, 0, true, {}, p.stop});
+            } else if (w < p.count) {
+                result.push_back(Piece{p.first + w, p.count - w, false, {}});
+            }
+            pieceStart = rowStart = pieceEnd;
+            i++;
+            w = 0;
+            enter();
+        };
+        // Moves to the row holding `offset`, carrying the rows before it over.
+        auto seek = [&](size_t offset) {
+            while (offset >= pieceEnd) emitRest();
+            Piece& p = pieces[i];
+            if (p.owned()) {
+                while (offset > rowStart + p.lines[w].size()) {
+                    rowStart += p.lines[w].size() + 1;
+                    emitLine(std::move(p.lines[w++]));
+                }
+                return;
+            }
+            size_t base = originalOffset(p.first);
+            size_t row = originalRowAt(base + offset - pieceStart) - p.first;
+            if (row <= w) return;
+            result.push_back(Piece{p.first + w, row - w, false, {}});
+            w = row;
+            rowStart = pieceStart + originalOffset(p.first + w) - base;
+        };
+        auto length = [&] {
+            const Piece& p = pieces[i];
+            return p.owned() ? p.lines[w].size() : originalLength(p.first + w);
+        };
+        // Steps over the current row, which a rewrite has taken in.
+        auto nextRow = [&] {
+            rowStart += length() + 1;
+            w++;
+            if (rowStart < pieceEnd) return;
+            pieceStart = pieceEnd;
+            i++;
+            w = 0;
+            enter();
+        };
+        // Appends the document from `pos` to `end` to `out`.
+        auto copyTo = [&](size_t end, std::string& out) {
+            while (pos < end) {
+                size_t lineEnd = rowStart + length();
+                if (pos == lineEnd) {
+                    out += '\n';
+                    pos++;
+                    nextRow();
+                    continue;
+                }
+                size_t n = std::min(end, lineEnd) - pos;
+                const Piece& p = pieces[i];
+                if (p.owned()) out.append(p.lines[w], pos - rowStart, n);
+                else out.append(originalView(p.first + w, pos - rowStart, n, scratch));
+                pos += n;
+            }
+        };
+        auto rewrite = [&] {
+            copyTo(rowStart + length(), text);
+            for (auto& line : splitLines(text)) emitLine(std::move(line));
+            nextRow();
+        };
+
+        enter();
+        bool open = false;
+        for (size_t k = 0; k < edits.size(); k++) {
+            const Edit& edit = edits[k];
+            if (open && edit.offset > rowStart + length()) {
+                rewrite();
+                open = false;
+            }
+            if (!open) {
+                seek(edit.offset);
+                pos = rowStart;
+                text.clear();
+                open = true;
+            }
+            copyTo(edit.offset, text);
+            copyTo(edit.offset + edit.length, removed[k]);
+            text += edit.text;
+        }
+        rewrite();
+        while (i < pieces.size()) emitRest();
+        pieces.swap(result);
+        return removed;
+    }
+
+    // Grows the last piece in place once it is owned; going through own()
+    // every time would move all of its lines. The first append to a file
+    // that is being followed does not index it.
+    void append(const std::string& text) override {
+        if (text.empty()) return;
+        size_t within;
+        if (pieces.back().open) ownLastOriginalLine();
+        else if (!pieces.back().owned()) own(lineCount() - 1, 1, within);
+        auto& lines = pieces.back().lines;
+        insertIntoLines(lines, lines.size() - 1, lines.back().size(), text);
+    }
+
+    // Original runs go out by their byte length, so the open one is
+    // written to the end of the original without indexing it first.
+    void writeTo(TextSink& sink) const override {
+        for (const auto& p : pieces) {
+            if (p.owned()) {
+                for (const auto& line : p.lines) {
+                    sink.write(line.data(), line.size());
+                    sink.write("\n", 1);
+                }
+            } else if (size_t bytes = originalBytes(p)) {
+                size_t start = originalOffset(p.first);
+                writeOriginal(sink, start, start + bytes - 1);
+                sink.write("\n", 1);
+            }
+        }
+    }
+};
+
+// Offsets kept in fixed-size blocks that clones share. The last block is
+// copied before it is extended while another clone still holds it, so a
+// clone costs one pointer per block instead of a copy of every offset.
+class SharedOffsets {
+    static constexpr size_t BlockSize = 1 << 16;
+
+    std::vector<std::shared_ptr<std::vector<size_t>>> blocks;
+    size_t count = 0;
+
+public:
+    explicit SharedOffsets(size_t first) { assign(first); }
+
+    size_t size() const { return count; }
+    size_t operator[](size_t i) const { return (*blocks[i / BlockSize])[i % BlockSize]; }
+
+    void assign(size_t first) {
+        blocks.clear();
+        count = 0;
+        append(&first, 1);
+    }
+
+    void append(const size_t* values, size_t n) {
+        while (n > 0) {
+            if (count % BlockSize == 0) {
+                blocks.push_back(std::make_shared<std::vector<size_t>>());
+                blocks.back()->reserve(BlockSize);
+            } else if (blocks.back().use_count() > 1) {
+                auto copy = std::make_shared<std::vector<size_t>>();
+                copy->reserve(BlockSize);
+                copy->assign(blocks.back()->begin(), blocks.back()->end());
+                blocks.back() = std::move(copy);
+            } else {
+                std::atomic_thread_fence(std::memory_order_acquire);
+            }
+            size_t take = std::min(n, BlockSize - count % BlockSize);
+            blocks.back()->insert(blocks.back()->end(), values, values + take);
+            values += take;
+            n -= take;
+            count += take;
+        }
+    }
+
+    // Blocks are counted in full even while a clone shares them.
+    size_t memoryUsage() const {
+        size_t bytes = heapBytes(blocks);
+        for (const auto& b : blocks) bytes += heapBytes(*b);
+        return bytes;
+    }
+};
+
+// Overlay on a read-only mapping of the file. Untouched lines are read
+// straight out of the mapping; the line-start index is extended in 1 MiB
+// blocks on demand, or in larger ones scanned on several threads when the
+// whole file is wanted.
+class MappedStorage : public OverlayStorage {
+    static constexpr size_t IndexBlock = 1 << 20, BulkIndexBlock = 64 << 20;
+
+    std::shared_ptr<const MappedFile> file;
+    mutable size_t textEnd = 0;
+    mutable SharedOffsets lineStarts{0};
+    mutable size_t scanned = 0;
+    mutable bool complete = true;
+
+protected:
+    void indexUntil(size_t lines) const override {
+        std::vector<size_t> found;
+        while (!complete && lineStarts.size() < lines) {
+            size_t end = std::min(textEnd, scanned + (lines == SIZE_MAX ? BulkIndexBlock : IndexBlock));
+            found.clear();
+            indexNewlines(file->data() + scanned, end - scanned, scanned + 1, found, indexThreads);
+            lineStarts.append(found.data(), found.size());
+            scanned = end;
+            complete = scanned == textEnd;
+        }
+    }
+
+    size_t indexedLines() const override { return lineStarts.size(); }
+
+    size_t originalOffset(size_t i) const override {
+        indexUntil(i + 1);
+        return lineStarts[i];
+    }
+
+    // Line starts indexed before the file was truncated may lie past the
+    // end of the text that is left.
+    size_t lineStart(size_t i) const { return std::min(lineStarts[i], textEnd); }
+
+    size_t originalLength(size_t i) const override {
+        indexUntil(i + 2);
+        size_t end = i + 1 < lineStarts.size() ? lineStarts[i + 1] - 1 : textEnd;
+        return std::min(end, textEnd) - lineStart(i);
+    }
+
+    size_t originalRowAt(size_t pos) const override {
+        while (!complete && scanned <= pos) indexUntil(lineStarts.size() + 1);
+        size_t lo = 0, hi = lineStarts.size();
+        while (lo < hi) {
+            size_t mid = lo + (hi - lo) / 2;
+            if (lineStarts[mid] <= pos) lo = mid + 1;
+            else hi = mid;
+        }
+        return lo - 1;
+    }
+
+    size_t originalEnd() const override { return textEnd; }
+
+    std::string originalLine(size_t i) const override {
+        return std::string(file->data() + lineStart(i), originalLength(i));
+    }
+
+    std::string_view originalView(size_t i, size_t col, size_t len, std::string&) const override {
+        std::string_view text(file->data() + lineStart(i), originalLength(i));
+        return col < text.size() ? text.substr(col, len) : std::string_view();
+    }
+
+    void writeOriginal(TextSink& sink, size_t begin, size_t end) const override {
+        end = std::min(end, textEnd);
+        if (begin < end) sink.write(file->data() + begin, end - begin);
+    }
+
+    std::string_view originalSpan(size_t begin, size_t end, bool, std::string&) const override {
+        end = std::min(end, textEnd);
+        begin = std::min(begin, end);
+        return std::string_view(file->data() + begin, end - begin);
+    }
+
+public:
+    std::unique_ptr<TextStorage> clone() const override { return std::make_unique<MappedStorage>(*this); }
+    bool readsFromFile() const override { return file && file->isMapped(); }
+    // The mapping itself is file-backed and left to the page cache.
+    size_t indexMemory() const override { return lineStarts.memoryUsage(); }
+
+    void load(const std::string& path) override {
+        file = std::make_shared<const MappedFile>(path);
+        if (file->size() == 0) {
+            assign("");
+            return;
+        }
+        textEnd = file->size() - (file->data()[file->size() - 1] == '\n');
+        lineStarts.assign(0);
+        scanned = 0;
+        complete = textEnd == 0;
+        openOriginal();
+    }
+
+    void clampToFile() const override {
+        if (!readsFromFile()) return;
+        textEnd = std::min(textEnd, file->guard());
+        if (scanned >= textEnd) {
+            scanned = textEnd;
+            complete = true;
+        }
+    }
+
+    // A file replaced by rename is ours alone and stays mapped. One changed
+    // in place is copied as far as it still goes; the clones that share the
+    // mapping are guarded against a shorter file but read what is there.
+    void detach() override {
+        if (!readsFromFile() || file->unlinked()) return;
+        clampToFile();
+        file = MappedFile::copyOf(std::string(file->data(), textEnd));
+    }
+
+    void assign(std::string text) override {
+        file.reset();
+        textEnd = scanned = 0;
+        lineStarts.assign(0);
+        complete = true;
+        OverlayStorage::assign(std::move(text));
+    }
+};
+
+// Overlay on a file that is never fully resident. The original is read with
+// pread in fixed-size pages and only a small LRU window of them is kept.
+// Instead of a line-start table, which alone would not fit in memory for
+// the files this is meant for, the index keeps one running newline count
+// per page; a line is located by binary search over those counts and a
+// scan of the one page that holds it.
+class PagedStorage : public OverlayStorage {
+    static constexpr size_t PageSize = 1 << 20;
+    static constexpr size_t WindowPages = 64;
+
+    struct Page {
+        size_t number;
+        std::string data;
+        std::vector<size_t> newlines;
+    };
+
+    int fd = -1;
+    mutable size_t textEnd = 0;
+    mutable std::vector<size_t> pageLineBase{0};
+    mutable bool complete = true;
+    mutable std::list<Page> window;
+
+    size_t readAt(char* dst, size_t len, size_t offset) const {
+        size_t done = 0;
+        while (done < len) {
+            ssize_t n = pread(fd, dst + done, len - done, offset + done);
+            if (n <= 0) break;
+            done += n;
+        }
+        return done;
+    }
+
+    const Page& page(size_t number) const {
+        for (auto it = window.begin(); it != window.end(); ++it) {
+            if (it->number == number) {
+                window.splice(window.begin(), window, it);
+                return window.front();
+            }
+        }
+        size_t start = number * PageSize;
+        Page p{number, std::string(std::min(PageSize, textEnd - std::min(start, textEnd)), '\0'), {}};
+        p.data.resize(readAt(p.data.data(), p.data.size(), start));
+        indexNewlines(p.data.data(), p.data.size(), start, p.newlines);
+        window.push_front(std::move(p));
+        if (window.size() > WindowPages) window.pop_back();
+        return window.front();
+    }
+
+    // One past the newline that ends line i - 1. A page read again after
+    // another program changed the file may hold fewer newlines than it was
+    // counted with; the lines it lost start past the end of the text.
+    size_t nextLineStart(size_t i) const {
+        if (i == 0) return 0;
+        size_t k = i - 1;
+        size_t p = std::upper_bound(pageLineBase.begin(), pageLineBase.end(), k) - pageLineBase.begin() - 1;
+        const auto& newlines = page(p).newlines;
+        return k - pageLineBase[p] < newlines.size() ? newlines[k - pageLineBase[p]] + 1 : SIZE_MAX;
+    }
+
+    size_t lineStart(size_t i) const { return std::min(nextLineStart(i), textEnd); }
+
+    void close() {
+        if (fd >= 0) ::close(fd);
+        fd = -1;
+        window.clear();
+        pageLineBase.assign(1, 0);
+        textEnd = 0;
+        complete = true;
+    }
+
+protected:
+    void indexUntil(size_t lines) const override {
+        while (!complete && indexedLines() < lines) {
+            size_t number = pageLineBase.size() - 1;
+            pageLineBase.push_back(pageLineBase.back() + page(number).newlines.size());
+            complete = (number + 1) * PageSize >= textEnd;
+        }
+    }
+
+    size_t indexedLines() const override { return pageLineBase.back() + 1; }
+
+    size_t originalOffset(size_t i) const override {
+        indexUntil(i + 1);
+        return lineStart(i);
+    }
+
+    size_t originalLength(size_t i) const override {
+        indexUntil(i + 2);
+        size_t start = lineStart(i);
+        size_t end = i + 1 < indexedLines() ? std::min(nextLineStart(i + 1) - 1, textEnd) : textEnd;
+        return end > start ? end - start : 0;
+    }
+
+    // Counts pages up to the one holding `pos` and searches its newlines.
+    size_t originalRowAt(size_t pos) const override {
+        size_t number = std::min(pos, textEnd) / PageSize;
+        while (!complete && pageLineBase.size() <= number + 1) indexUntil(indexedLines() + 1);
+        number = std::min(number, pageLineBase.size() - 1);
+        const auto& newlines = page(number).newlines;
+        size_t row = pageLineBase[number] + (std::lower_bound(newlines.begin(), newlines.end(), pos) - newlines.begin());
+        return std::min(row, indexedLines() - 1);
+    }
+
+    size_t originalEnd() const override { return textEnd; }
+
+    std::string originalLine(size_t i) const override {
+        std::string result;
+        originalView(i, 0, SIZE_MAX, result);
+        return result;
+    }
+
+    // Pages can be evicted by the next lookup, so lines are always copied,
+    // but only the requested columns: a long line is never read whole to
+    // show a screenful of it.
+    std::string_view originalView(size_t i, size_t col, size_t len, std::string& scratch) const override {
+        size_t length = originalLength(i);
+        size_t pos = lineStart(i) + std::min(col, length);
+        len = std::min(len, length - std::min(col, length));
+        scratch.clear();
+        scratch.reserve(len);
+        while (scratch.size() < len) {
+            const Page& p = page(pos / PageSize);
+            size_t skip = pos % PageSize;
+            size_t take = skip < p.data.size() ? std::min(len - scratch.size(), p.data.size() - skip) : 0;
+            if (take == 0) break;
+            scratch.append(p.data, skip, take);
+            pos += take;
+        }
+        return scratch;
+    }
+
+    // Streams the byte range straight from the file so a save does not
+    // churn the page window.
+    void writeOriginal(TextSink& sink, size_t start, size_t end) const override {
+        end = std::min(end, textEnd);
+        std::vector<char> chunk(PageSize);
+        while (start < end) {
+            size_t n = readAt(chunk.data(), std::min(PageSize, end - start), start);
+            if (n == 0) break;
+            sink.write(chunk.data(), n);
+            sink.flush();
+            start += n;
+        }
+    }
+
+    // At most the part of one page, copied like lines are.
+    std::string_view originalSpan(size_t begin, size_t end, bool fromEnd, std::string& scratch) const override {
+        end = std::min(end, textEnd);
+        begin = std::min(begin, end);
+        scratch.clear();
+        if (begin == end) return scratch;
+        size_t number = (fromEnd ? end - 1 : begin) / PageSize;
+        const Page& p = page(number);
+        size_t first = std::max(begin, number * PageSize), last = std::min(end, number * PageSize + p.data.size());
+        if (first < last) scratch.assign(p.data, first - number * PageSize, last - first);
+        return scratch;
+    }
+
+public:
+    PagedStorage() = default;
+    PagedStorage(const PagedStorage& other)
+        : OverlayStorage(other), fd(other.fd >= 0 ? dup(other.fd) : -1), textEnd(other.textEnd),
+          pageLineBase(other.pageLineBase), complete(other.complete) {}
+    PagedStorage& operator=(const PagedStorage&) = delete;
+    ~PagedStorage() override { close(); }
+
+    std::unique_ptr<TextStorage> clone() const override { return std::make_unique<PagedStorage>(*this); }
+    bool readsFromFile() const override { return fd >= 0; }
+
+    void clampToFile() const override {
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) != 0 || size_t(st.st_size) >= textEnd) return;
+        textEnd = st.st_size;
+        window.remove_if([&](const Page& p) { return p.number * PageSize + p.data.size() > textEnd; });
+        complete = complete || (pageLineBase.size() - 1) * PageSize >= textEnd;
+    }
+
+    // The file may not fit in memory, so it goes on being read as far as
+    // it still goes.
+    void detach() override { clampToFile(); }
+    size_t textMemory() const override {
+        size_t bytes = OverlayStorage::textMemory();
+        for (const auto& p : window) bytes += sizeof(Page) + p.data.capacity();
+        return bytes;
+    }
+    size_t indexMemory() const override {
+        size_t bytes = heapBytes(pageLineBase);
+        for (const auto& p : window) bytes += heapBytes(p.newlines);
+        return bytes;
+    }
+
+    void load(const std::string& path) override {
+        close();
+        fd = open(path.c_str(), O_RDONLY);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) != 0 || st.st_size == 0) {
+            assign("");
+            return;
+        }
+        char last = 0;
+        readAt(&last, 1, st.st_size - 1);
+        textEnd = st.st_size - (last == '\n');
+        complete = textEnd == 0;
+        openOriginal();
+    }
+
+    void assign(std::string text) override {
+        close();
+        OverlayStorage::assign(std::move(text));
+    }
+};
+
+// Writes a replacement for `path` into a temp file in the same directory,
+// then fsyncs and renames it over the target, so a crash or a full disk
+// leaves either the old file or the new one. Small spans are copied into a
+// staging buffer; large ones are passed to writev as they are.
+class AtomicFileWriter : public TextSink {
+    static constexpr size_t StagingSize = 1 << 20, SmallSpan = 4096;
+    static constexpr size_t MaxBatchBytes = 8 << 20, MaxBatchSpans = 1024;
+
+    std::string target, tmpPath;
+    int fd = -1;
+    bool committed = false;
+    std::vector<iovec> batch;
+    std::vector<char> staging;
+    size_t pending = 0, written = 0;
+    std::atomic<size_t>* progress = nullptr;
+
+    [[noreturn]] void fail(const std::string& what) const {
+        throw std::system_error(errno, std::generic_category(), what + " " + tmpPath);
+    }
+
+public:
+    explicit AtomicFileWriter(const std::string& path) : target(path) {
+        if (fs::is_symlink(target)) target = fs::canonical(target).string();
+        fs::path p(target);
+        std::string pattern = (p.parent_path() / ("." + p.filename().string() + ".XXXXXX")).string();
+        fd = mkstemp(pattern.data());
+        tmpPath = pattern;
+        if (fd < 0) fail("cannot create");
+        struct stat st;
+        if (stat(target.c_str(), &st) == 0) {
+            fchmod(fd, st.st_mode & 07777);
+        } else {
+            mode_t mask = umask(0);
+            umask(mask);
+            fchmod(fd, 0666 & ~mask);
+        }
+        staging.reserve(StagingSize);
+    }
+
+    ~AtomicFileWriter() override {
+        if (fd >= 0) close(fd);
+        if (!committed) unlink(tmpPath.c_str());
+    }
+
+    void write(const char* data, size_t len) override {
+        if (len == 0) return;
+        if (len < SmallSpan) {
+            if (staging.size() + len > staging.capacity()) flush();
+            char* end = staging.data() + staging.size();
+            staging.insert(staging.end(), data, data + len);
+            if (!batch.empty() && static_cast<char*>(batch.back().iov_base) + batch.back().iov_len == end) {
+                batch.back().iov_len += len;
+            } else {
+                batch.push_back({end, len});
+            }
+        } else {
+            batch.push_back({const_cast<char*>(data), len});
+        }
+        pending += len;
+        if (pending >= MaxBatchBytes || batch.size() >= MaxBatchSpans) flush();
+    }
+
+    void flush() override {
+        for (size_t i = 0; i < batch.size();) {
+            ssize_t n = writev(fd, batch.data() + i, std::min(batch.size() - i, MaxBatchSpans));
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                fail("cannot write");
+            }
+            written += n;
+            if (progress) *progress = written;
+            for (; i < batch.size() && size_t(n) >= batch[i].iov_len; i++) n -= batch[i].iov_len;
+            if (n > 0) {
+                batch[i].iov_base = static_cast<char*>(batch[i].iov_base) + n;
+                batch[i].iov_len -= n;
+            }
+        }
+        batch.clear();
+        staging.clear();
+        pending = 0;
+    }
+
+    void commit() {
+        flush();
+        if (fsync(fd) != 0) fail("cannot fsync");
+        if (close(fd) != 0) {
+            fd = -1;
+            fail("cannot close");
+        }
+        fd = -1;
+        if (rename(tmpPath.c_str(), target.c_str()) != 0) fail("cannot rename");
+        committed = true;
+        std::string dirPath = fs::path(target).parent_path().string();
+        int dir = open(dirPath.empty() ? "." : dirPath.c_str(), O_RDONLY | O_DIRECTORY);
+        if (dir >= 0) {
+            fsync(dir);
+            close(dir);
+        }
+    }
+
+    size_t bytesWritten() const { return written; }
+    void setProgress(std::atomic<size_t>* counter) { progress = counter; }
+};
+
+size_t rewriteFile(const TextStorage& storage, const std::string& path, std::atomic<size_t>* progress) {
+    AtomicFileWriter writer(path);
+    writer.setProgress(progress);
+    storage.writeTo(writer);
+    writer.commit();
+    return writer.bytesWritten();
+}
+
+// True if writing the planned regions leaves every '\n' of the file's text
+// where it is. Compares the file with the snapshot over the patches and
+// over any tail the patch cuts off; past the old text nothing was indexed.
+bool patchKeepsNewlines(const SaveRequest& request) {
+    constexpr size_t CompareChunk = 1 << 20;
+    int fd = open(request.path.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+    auto readAt = [&](std::string& out, size_t len, size_t offset) {
+        out.resize(len);
+        size_t done = 0;
+        while (done < len) {
+            ssize_t n = pread(fd, out.data() + done, len - done, offset + done);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) break;
+            done += n;
+        }
+        out.resize(done);
+    };
+    std::string old, now;
+    std::vector<size_t> oldBreaks, newBreaks;
+    size_t textEnd = request.expected.size;
+    readAt(old, 1, textEnd - 1);
+    if (old == "\n") textEnd--;
+    auto regions = request.patches;
+    if (request.fileSize < textEnd) regions.push_back({request.fileSize, textEnd});
+    bool same = true;
+    for (auto [begin, end] : regions) {
+        end = std::min(end, textEnd);
+        for (size_t pos = begin; same && pos < end; pos += CompareChunk) {
+            size_t len = std::min(CompareChunk, end - pos);
+            readAt(old, len, pos);
+            now = pos < request.fileSize ? request.snapshot->read(pos, len) : std::string();
+            oldBreaks.clear();
+            newBreaks.clear();
+            indexNewlines(old.data(), old.size(), 0, oldBreaks);
+            indexNewlines(now.data(), std::min(len, now.size()), 0, newBreaks);
+            same = oldBreaks == newBreaks;
+        }
+    }
+    close(fd);
+    return same;
+}
+
+// Writes only the planned regions into the existing file. Not atomic: a
+// crash part-way leaves a mix of old and new bytes, which is the price of
+// not rewriting gigabytes for a one-byte fix.
+size_t patchFile(const SaveRequest& request, std::atomic<size_t>* progress) {
+    constexpr size_t PatchChunk = 1 << 20;
+    int fd = open(request.path.c_str(), O_WRONLY);
+    if (fd < 0) throw std::system_error(errno, std::generic_category(), "cannot open " + request.path);
+    auto fail = [&](const char* what) {
+        int err = errno;
+        close(fd);
+        throw std::system_error(err, std::generic_category(), what + (" " + request.path));
+    };
+    size_t written = 0;
+    for (auto [begin, end] : request.patches) {
+        for (size_t pos = begin; pos < end;) {
+            std::string bytes = request.snapshot->read(pos, std::min(PatchChunk, end - pos));
+            for (size_t done = 0; done < bytes.size();) {
+                ssize_t n = pwrite(fd, bytes.data() + done, bytes.size() - done, pos + done);
+                if (n < 0 && errno == EINTR) continue;
+                if (n <= 0) fail("cannot write");
+                done += n;
+            }
+            pos += bytes.size();
+            written += bytes.size();
+            if (progress) *progress = written;
+            if (bytes.empty()) break;
+        }
+    }
+    if (ftruncate(fd, request.fileSize) != 0) fail("cannot truncate");
+    if (fsync(fd) != 0) fail("cannot fsync");
+    close(fd);
+    return written;
+}
+
+// The undo file is a magic header followed by records: a kind byte and
+// fixed-width fields in host byte order, so it can be scanned in place
+// through a mapping. Edits carry their text inline; joined edits are the
+// later parts of a batch. A checkpoint carries the stamp of the saved file
+// that the records before it lead up to; anything after the last
+// checkpoint is an interrupted append.
+constexpr char UndoMagic[8] = {'T', 'T', 'U', 'N', 'D', 'O', '1', '\n'};
+
+namespace UndoRecord {
+constexpr char Edit = 'E', Joined = 'J', Undo = 'U', Redo = 'R', Trim = 'T', Checkpoint = 'C';
+}
+
+void appendU64(std::string& out, uint64_t value) {
+    out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+void appendEntryRecord(std::string& out, const UndoLog::Entry& entry) {
+    out += entry.joined ? UndoRecord::Joined : UndoRecord::Edit;
+    appendU64(out, entry.offset);
+    appendU64(out, entry.removed.size());
+    appendU64(out, entry.inserted.size());
+    out += entry.removed;
+    out += entry.inserted;
+}
+
+void appendCheckpointRecord(std::string& out, const FileStamp& stamp) {
+    out += UndoRecord::Checkpoint;
+    appendU64(out, stamp.device);
+    appendU64(out, stamp.inode);
+    appendU64(out, stamp.size);
+    appendU64(out, stamp.mtimeNs);
+}
+
+struct UndoRecordReader {
+    const char* data;
+    size_t len;
+    size_t pos = 0;
+    FileStamp stamp = {};
+
+    bool readU64(uint64_t& value) {
+        if (len - pos < sizeof(value)) return false;
+        std::memcpy(&value, data + pos, sizeof(value));
+        pos += sizeof(value);
+        return true;
+    }
+
+    // Reads one record; false at the end or on a truncated record. Edit
+    // text is skipped rather than copied when `entry` is null.
+    bool next(char& kind, UndoLog::Entry* entry) {
+        if (pos >= len) return false;
+        kind = data[pos++];
+        if (kind == UndoRecord::Edit || kind == UndoRecord::Joined) {
+            uint64_t offset, removed, inserted;
+            if (!readU64(offset) || !readU64(removed) || !readU64(inserted)) return false;
+            if (removed > len - pos || inserted > len - pos - removed) return false;
+            if (entry) {
+                entry->offset = offset;
+                entry->removed.assign(data + pos, removed);
+                entry->inserted.assign(data + pos + removed, inserted);
+            }
+            pos += removed + inserted;
+            return true;
+        }
+        if (kind == UndoRecord::Checkpoint) {
+            uint64_t mtime;
+            if (!readU64(stamp.device) || !readU64(stamp.inode) || !readU64(stamp.size) || !readU64(mtime)) return false;
+            stamp.mtimeNs = mtime;
+            stamp.valid = true;
+            return true;
+        }
+        return kind == UndoRecord::Undo || kind == UndoRecord::Redo || kind == UndoRecord::Trim;
+    }
+
+    // Returns the end of the last complete checkpoint, or 0 if there is none.
+    size_t lastCheckpoint(FileStamp& checkpoint) {
+        size_t end = 0;
+        for (char kind; next(kind, nullptr);) {
+            if (kind == UndoRecord::Checkpoint) {
+                end = pos;
+                checkpoint = stamp;
+            }
+        }
+        return end;
+    }
+};
+
+// Writes `records` at `offset`, dropping whatever followed it.
+void writeUndoRecords(const std::string& path, size_t offset, const std::string& records) {
+    int fd = open(path.c_str(), O_WRONLY);
+    if (fd < 0) throw std::system_error(errno, std::generic_category(), "cannot open " + path);
+    for (size_t done = 0; done < records.size();) {
+        ssize_t n = pwrite(fd, records.data() + done, records.size() - done, offset + done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            int err = errno;
+            close(fd);
+            throw std::system_error(err, std::generic_category(), "cannot write " + path);
+        }
+        done += n;
+    }
+    if (ftruncate(fd, offset + records.size()) != 0) {
+        int err = errno;
+        close(fd);
+        throw std::system_error(err, std::generic_category(), "cannot truncate " + path);
+    }
+    close(fd);
+}
+
+}
+
+std::string undoFilePath(const std::string& path) {
+    fs::path p(path);
+    return (p.parent_path() / ("." + p.filename().string() + ".ttundo")).string();
+}
+
+namespace {
+
+FileStamp stampOf(const struct stat& st) {
+    FileStamp stamp;
+    stamp.valid = true;
+    stamp.device = st.st_dev;
+    stamp.inode = st.st_ino;
+    stamp.size = st.st_size;
+    stamp.mtimeNs = int64_t(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+    return stamp;
+}
+
+}  // namespace
+
+FileStamp stampFile(const std::string& path) {
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0) return FileStamp{};
+    return stampOf(st);
+}
+
+namespace {
+
+// Gear hash boundaries: a chunk may end after any byte where the top bits
+// of a hash of the 64 bytes up to it are zero, about one in 64 KiB, and is
+// kept between MinChunk and MaxChunk. The hash sees exactly those 64 bytes,
+// so large inputs are searched for candidates in parallel slices.
+constexpr size_t MinChunk = 16 << 10, MaxChunk = 256 << 10;
+constexpr uint64_t BoundaryMask = uint64_t(0xffff) << 48;
+
+const std::array<uint64_t, 256>& gearTable() {
+    static const std::array<uint64_t, 256> table = [] {
+        std::array<uint64_t, 256> t{};
+        uint64_t x = 0x9e3779b97f4a7c15;
+        for (auto& v : t) {
+            uint64_t z = (x += 0x9e3779b97f4a7c15);
+            z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+            z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+            v = z ^ (z >> 31);
+        }
+        return t;
+    }();
+    return table;
+}
+
+// Appends every candidate chunk end in [begin, end) to `out`. The range is
+// walked as four interleaved lanes, since a single hash is bound by the
+// latency of its own updates.
+void chunkCandidates(std::string_view text, size_t begin, size_t end, std::vector<size_t>& out) {
+    const uint64_t* gear = gearTable().data();
+    const unsigned char* bytes = reinterpret_cast<const unsigned char*>(text.data());
+    auto warm = [&](size_t at) {
+        uint64_t h = 0;
+        for (size_t i = at >= 64 ? at - 64 : 0; i < at; i++) h = (h << 1) + gear[bytes[i]];
+        return h;
+    };
+    size_t lane = (end - begin) / 4;
+    const unsigned char *p0 = bytes + begin, *p1 = p0 + lane, *p2 = p1 + lane, *p3 = p2 + lane;
+    uint64_t h0 = warm(begin), h1 = warm(begin + lane), h2 = warm(begin + 2 * lane), h3 = warm(begin + 3 * lane);
+    std::vector<size_t> found[4];
+    for (size_t k = 0; k < lane; k++) {
+        h0 = (h0 << 1) + gear[p0[k]];
+        h1 = (h1 << 1) + gear[p1[k]];
+        h2 = (h2 << 1) + gear[p2[k]];
+        h3 = (h3 << 1) + gear[p3[k]];
+        if (__builtin_expect(!((h0 & BoundaryMask) && (h1 & BoundaryMask) && (h2 & BoundaryMask) && (h3 & BoundaryMask)), 0)) {
+            size_t at = begin + k + 1;
+            if (!(h0 & BoundaryMask)) found[0].push_back(at);
+            if (!(h1 & BoundaryMask)) found[1].push_back(at + lane);
+            if (!(h2 & BoundaryMask)) found[2].push_back(at + 2 * lane);
+            if (!(h3 & BoundaryMask)) found[3].push_back(at + 3 * lane);
+        }
+    }
+    for (size_t i = begin + 4 * lane; i < end; i++) {
+        h3 = (h3 << 1) + gear[bytes[i]];
+        if (!(h3 & BoundaryMask)) found[3].push_back(i + 1);
+    }
+    for (const auto& f : found) out.insert(out.end(), f.begin(), f.end());
+}
+
+std::vector<TextChunk> chunkText(std::string_view text, unsigned threads) {
+    threads = workerCount(threads);
+    size_t slices = text.size() < ParallelIndexThreshold ? 1 : threads * 4;
+    size_t sliceSize = (text.size() + slices - 1) / slices;
+    std::vector<std::vector<size_t>> candidates(slices);
+    parallelFor(slices, slices == 1 ? 1 : threads, [&](size_t i) {
+        size_t begin = std::min(text.size(), i * sliceSize);
+        chunkCandidates(text, begin, std::min(text.size(), begin + sliceSize), candidates[i]);
+    });
+
+    std::vector<TextChunk> chunks;
+    size_t start = 0, slice = 0, next = 0;
+    while (start < text.size()) {
+        size_t limit = std::min(start + MaxChunk, text.size()), end = limit;
+        for (; slice < slices; slice++, next = 0) {
+            auto& c = candidates[slice];
+            while (next < c.size() && c[next] < start + MinChunk) next++;
+            if (next < c.size()) {
+                end = std::min(c[next], limit);
+                break;
+            }
+        }
+        chunks.push_back(TextChunk{start, end - start, 0});
+        start = end;
+    }
+    parallelFor(chunks.size(), slices == 1 ? 1 : threads, [&](size_t i) {
+        chunks[i].hash = std::hash<std::string_view>{}(text.substr(chunks[i].offset, chunks[i].length));
+    });
+    return chunks;
+}
+
+// Edits that turn the text `from` describes into `to`, chunked as `chunks`.
+// Chunks are matched in order, so each run of unmatched chunks on either
+// side becomes one edit.
+std::vector<Edit> diffChunks(const std::vector<TextChunk>& from, const std::vector<TextChunk>& chunks, std::string_view to) {
+    std::unordered_map<uint64_t, std::vector<size_t>> where;
+    for (size_t i = 0; i < from.size(); i++) where[from[i].hash].push_back(i);
+    size_t fromSize = from.empty() ? 0 : from.back().offset + from.back().length;
+    auto fromOffset = [&](size_t i) { return i < from.size() ? from[i].offset : fromSize; };
+    auto toOffset = [&](size_t i) { return i < chunks.size() ? chunks[i].offset : to.size(); };
+    std::vector<Edit> edits;
+    size_t next = 0, pending = 0;
+    // Replaces chunks [next, matched) of `from` with [pending, upTo) of `to`.
+    auto edit = [&](size_t matched, size_t upTo) {
+        size_t begin = fromOffset(next), end = fromOffset(matched);
+        size_t textBegin = toOffset(pending), textEnd = toOffset(upTo);
+        if (end > begin || textEnd > textBegin) {
+            edits.push_back(Edit{begin, end - begin, std::string(to.substr(textBegin, textEnd - textBegin))});
+        }
+    };
+    for (size_t i = 0; i < chunks.size(); i++) {
+        auto it = where.find(chunks[i].hash);
+        if (it == where.end()) continue;
+        auto match = std::lower_bound(it->second.begin(), it->second.end(), next);
+        if (match == it->second.end() || from[*match].length != chunks[i].length) continue;
+        edit(*match, i);
+        next = *match + 1;
+        pending = i + 1;
+    }
+    edit(from.size(), chunks.size());
+    return edits;
+}
+
+// Where the chunk starting at `start` ends, as chunkText decides it, with
+// only the bytes it needs read from `text`; `bytes` receives the chunk.
+size_t chunkEnd(const TextStorage& text, size_t start, size_t size, std::string& bytes) {
+    size_t limit = std::min(start + MaxChunk, size);
+    bytes = text.read(start, limit - start);
+    if (limit - start <= MinChunk) return limit;
+    const uint64_t* gear = gearTable().data();
+    const unsigned char* b = reinterpret_cast<const unsigned char*>(bytes.data());
+    uint64_t h = 0;
+    for (size_t i = MinChunk - 64; i < MinChunk; i++) h = (h << 1) + gear[b[i]];
+    size_t at = MinChunk;
+    for (; at < limit - start && (h & BoundaryMask); at++) h = (h << 1) + gear[b[at]];
+    bytes.resize(at);
+    return start + at;
+}
+
+// The chunks of `text`, given those of an older version that differs from
+// it only in `changes`. From a boundary both versions share, equal bytes
+// are chunked alike, so chunking restarts at the chunk holding a change
+// and stops at the first shared boundary whose hash window is past it.
+std::vector<TextChunk> rechunk(const std::vector<TextChunk>& old, const DirtyRanges& changes, const TextStorage& text) {
+    const auto& ranges = changes.edited();
+    size_t size = text.size(), oldEnd = old.empty() ? 0 : old.back().offset + old.back().length;
+    std::vector<TextChunk> chunks;
+    std::string bytes;
+    size_t i = 0, r = 0;
+    int64_t shift = 0;  // growth of ranges[0, r)
+    while (r < ranges.size()) {
+        // The chunk ending the old text is redone too: more text may follow.
+        size_t from = ranges[r].begin - shift;
+        for (; i < old.size() && old[i].offset + old[i].length <= from && old[i].offset + old[i].length < oldEnd; i++) {
+            chunks.push_back(TextChunk{old[i].offset + shift, old[i].length, old[i].hash});
+        }
+        size_t pos = (i < old.size() ? old[i].offset : oldEnd) + shift;
+        for (;;) {
+            if (pos >= size) return chunks;
+            size_t end = chunkEnd(text, pos, size, bytes);
+            chunks.push_back(TextChunk{pos, end - pos, std::hash<std::string_view>{}(bytes)});
+            pos = end;
+            while (r < ranges.size() && ranges[r].end + 64 <= pos) shift += ranges[r++].delta;
+            if (r < ranges.size() && ranges[r].begin < pos) continue;
+            while (i < old.size() && old[i].offset + shift < pos) i++;
+            if (i < old.size() && old[i].offset + shift == pos) break;
+        }
+    }
+    for (; i < old.size(); i++) chunks.push_back(TextChunk{old[i].offset + shift, old[i].length, old[i].hash});
+    return chunks;
+}
+
+}  // namespace
+
+// The file is stamped before and after reading, so a write that lands in
+// between leaves the image unknown rather than wrong.
+DiskImage scanFile(const std::string& path, unsigned threads) {
+    DiskImage image;
+    image.stamp = stampFile(path);
+    image.chunks = chunkText(readText(path), threads);
+    image.known = stampFile(path) == image.stamp;
+    return image;
+}
+
+// Stamped once the file is written, so a change made after that is seen
+// by the next syncWithDisk.
+DiskImage imageAfterSave(const SaveRequest& request) {
+    if (!request.image.known) return DiskImage{};
+    return DiskImage{stampFile(request.path), rechunk(request.image.chunks, request.changes, *request.snapshot), true};
+}
+
+FileWatcher::FileWatcher() : fd(inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) {}
+
+FileWatcher::~FileWatcher() {
+    if (fd >= 0) close(fd);
+}
+
+void FileWatcher::watch(const std::string& path) {
+    if (fd < 0 || path.empty()) return;
+    fs::path full = fs::absolute(path).lexically_normal();
+    auto& spellings = files[full.string()];
+    if (std::find(spellings.begin(), spellings.end(), path) == spellings.end()) spellings.push_back(path);
+    constexpr uint32_t mask = IN_MODIFY | IN_CLOSE_WRITE | IN_CREATE | IN_MOVED_TO;
+    int wd = inotify_add_watch(fd, full.parent_path().c_str(), mask);
+    if (wd >= 0) directories[wd] = full.parent_path().string();
+}
+
+std::vector<std::string> FileWatcher::poll() {
+    auto now = Clock::now();
+    alignas(inotify_event) char buf[4096];
+    ssize_t n;
+    while (fd >= 0 && (n = read(fd, buf, sizeof buf)) > 0) {
+        for (char* p = buf; p < buf + n;) {
+            auto* event = reinterpret_cast<inotify_event*>(p);
+            p += sizeof(inotify_event) + event->len;
+            auto dir = directories.find(event->wd);
+            if (dir == directories.end() || event->len == 0) continue;
+            auto file = files.find((fs::path(dir->second) / event->name).string());
+            if (file == files.end()) continue;
+            pending.emplace(file->first, Pending{now, now}).first->second.last = now;
+        }
+    }
+    std::vector<std::string> changed;
+    for (auto it = pending.begin(); it != pending.end();) {
+        if (now - it->second.last < QuietPeriod && now - it->second.first < MaxDelay) {
+            ++it;
+            continue;
+        }
+        const auto& spellings = files[it->first];
+        changed.insert(changed.end(), spellings.begin(), spellings.end());
+        it = pending.erase(it);
+    }
+    return changed;
+}
+
+bool FileTail::open(const std::string& path, size_t from) {
+    close();
+    fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    this->path = path;
+    offset = from;
+    return fd >= 0;
+}
+
+void FileTail::close() {
+    if (fd >= 0) ::close(fd);
+    fd = -1;
+}
+
+bool FileTail::read(std::string& out, size_t limit) {
+    struct stat st, named;
+    if (fd < 0 || fstat(fd, &st) != 0 || size_t(st.st_size) < offset) return false;
+    if (stat(path.c_str(), &named) == 0 && (named.st_dev != st.st_dev || named.st_ino != st.st_ino)) return false;
+    size_t start = out.size(), want = std::min(size_t(st.st_size) - offset, limit), got = 0;
+    out.resize(start + want);
+    while (got < want) {
+        ssize_t n = pread(fd, out.data() + start + got, want - got, offset + got);
+        if (n <= 0) break;
+        got += n;
+    }
+    out.resize(start + got);
+    offset += got;
+    return true;
+}
+
+FileStamp FileTail::stamp() const {
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) return FileStamp{};
+    return stampOf(st);
+}
+
+// The worker polls with a timeout so that it notices being stopped even
+// while the producer is silent.
+StreamReader::StreamReader(int fd) : fd(fd) {
+    worker = std::thread([this] {
+        std::string chunk(1 << 20, '\0');
+        for (;;) {
+            {
+                std::unique_lock<std::mutex> hold(lock);
+                space.wait(hold, [this] { return stopping || pending.size() < Backlog; });
+                if (stopping) break;
+            }
+            pollfd ready{this->fd, POLLIN, 0};
+            if (::poll(&ready, 1, 100) == 0) continue;
+            ssize_t n = read(this->fd, chunk.data(), chunk.size());
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) break;
+            std::lock_guard<std::mutex> hold(lock);
+            pending.append(chunk.data(), n);
+            total += n;
+        }
+        done = true;
+    });
+}
+
+StreamReader::~StreamReader() {
+    {
+        std::lock_guard<std::mutex> hold(lock);
+        stopping = true;
+    }
+    space.notify_one();
+    worker.join();
+    close(fd);
+}
+
+void StreamReader::take(std::string& out, size_t limit) {
+    {
+        std::lock_guard<std::mutex> hold(lock);
+        size_t n = std::min(limit, pending.size());
+        out.append(pending, 0, n);
+        pending.erase(0, n);
+    }
+    space.notify_one();
+}
+
+bool StreamReader::finished() {
+    std::lock_guard<std::mutex> hold(lock);
+    return done && pending.empty();
+}
+
+SaveStats performSave(const SaveRequest& request, std::atomic<size_t>* progress) {
+    auto start = std::chrono::steady_clock::now();
+    SaveStats stats;
+    if (request.inPlace && stampFile(request.path) == request.expected &&
+        (!request.keepNewlines || patchKeepsNewlines(request))) {
+        stats.bytes = patchFile(request, progress);
+        stats.inPlace = true;
+    } else {
+        stats.bytes = rewriteFile(*request.snapshot, request.path, progress);
+    }
+    stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return stats;
+}
+
+void DirtyRanges::inserted(size_t offset, size_t len) {
+    if (len == 0) return;
+    size_t i = 0;
+    while (i < ranges.size() && ranges[i].end < offset) i++;
+    if (i < ranges.size() && ranges[i].begin <= offset) {
+        ranges[i].end += len;
+        ranges[i].delta += len;
+    } else {
+        ranges.insert(ranges.begin() + i, Range{offset, offset + len, int64_t(len)});
+    }
+    for (size_t j = i + 1; j < ranges.size(); j++) {
+        ranges[j].begin += len;
+        ranges[j].end += len;
+    }
+}
+
+void DirtyRanges::erased(size_t offset, size_t len) {
+    if (len == 0) return;
+    size_t i = 0;
+    while (i < ranges.size() && ranges[i].end < offset) i++;
+    Range merged{offset, offset + len, -int64_t(len)};
+    size_t j = i;
+    for (; j < ranges.size() && ranges[j].begin <= offset + len; j++) {
+        merged.begin = std::min(merged.begin, ranges[j].begin);
+        merged.end = std::max(merged.end, ranges[j].end);
+        merged.delta += ranges[j].delta;
+    }
+    merged.end -= len;
+    ranges.erase(ranges.begin() + i, ranges.begin() + j);
+    ranges.insert(ranges.begin() + i, merged);
+    for (j = i + 1; j < ranges.size(); j++) {
+        ranges[j].begin -= len;
+        ranges[j].end -= len;
+    }
+}
+
+// Walks the ranges and the edits together, merging whatever overlaps or
+// touches into one range, then moves it by the edits that came before.
+void DirtyRanges::applied(const std::vector<Edit>& edits) {
+    auto growth = [](const Edit& e) { return int64_t(e.text.size()) - int64_t(e.length); };
+    std::vector<Range> merged;
+    merged.reserve(ranges.size() + edits.size());
+    size_t i = 0, j = 0;
+    int64_t shift = 0;
+    while (i < ranges.size() || j < edits.size()) {
+        Range range;
+        int64_t grown = 0;
+        if (i == ranges.size() || (j < edits.size() && edits[j].offset < ranges[i].begin)) {
+            range = Range{edits[j].offset, edits[j].offset + edits[j].length, 0};
+            grown = growth(edits[j++]);
+        } else {
+            range = ranges[i++];
+        }
+        for (;;) {
+            if (i < ranges.size() && ranges[i].begin <= range.end) {
+                range.end = std::max(range.end, ranges[i].end);
+                range.delta += ranges[i++].delta;
+            } else if (j < edits.size() && edits[j].offset <= range.end) {
+                range.end = std::max(range.end, edits[j].offset + edits[j].length);
+                grown += growth(edits[j++]);
+            } else {
+                break;
+            }
+        }
+        range.begin += shift;
+        range.end += shift + grown;
+        range.delta += grown;
+        shift += grown;
+        merged.push_back(range);
+    }
+    ranges.swap(merged);
+}
+
+// A range at [begin, end) of the document covers [begin - shift,
+// end - shift - delta) of the saved file, `shift` being the growth of the
+// ranges before it.
+bool DirtyRanges::fromDisk(std::vector<Edit>& edits) const {
+    size_t i = 0;
+    int64_t shift = 0;
+    for (auto& edit : edits) {
+        for (; i < ranges.size(); i++) {
+            size_t begin = ranges[i].begin - shift, end = ranges[i].end - shift - ranges[i].delta;
+            if (begin > edit.offset + edit.length) break;
+            if (end >= edit.offset) return false;
+            shift += ranges[i].delta;
+        }
+        edit.offset += shift;
+    }
+    return true;
+}
+
+void DirtyRanges::moved(const std::vector<Edit>& edits) {
+    size_t j = 0;
+    int64_t shift = 0;
+    for (auto& r : ranges) {
+        for (; j < edits.size() && edits[j].offset < r.begin; j++) {
+            shift += int64_t(edits[j].text.size()) - int64_t(edits[j].length);
+        }
+        r.begin += shift;
+        r.end += shift;
+    }
+}
+
+int64_t DirtyRanges::sizeDelta() const {
+    int64_t delta = 0;
+    for (const auto& r : ranges) delta += r.delta;
+    return delta;
+}
+
+// Untouched bytes between ranges are where they were on disk only while
+// the deltas before them sum to zero; otherwise they moved and must be
+// written too.
+std::vector<std::pair<size_t, size_t>> DirtyRanges::regions(size_t fileSize, bool& shifted) const {
+    std::vector<std::pair<size_t, size_t>> out;
+    auto add = [&](size_t begin, size_t end) {
+        if (begin >= end) return;
+        if (!out.empty() && out.back().second >= begin) out.back().second = std::max(out.back().second, end);
+        else out.push_back({begin, end});
+    };
+    shifted = false;
+    int64_t shift = 0;
+    size_t pos = 0;
+    for (const auto& r : ranges) {
+        if (shift != 0) {
+            shifted |= r.begin > pos;
+            add(pos, r.begin);
+        }
+        add(r.begin, r.end);
+        shift += r.delta;
+        pos = r.end;
+    }
+    if (shift != 0) {
+        shifted |= fileSize > pos;
+        add(pos, fileSize);
+    }
+    return out;
+}
+
+std::unique_ptr<TextStorage> makeStorage(const BufferOptions& options) {
+    std::unique_ptr<TextStorage> storage;
+    switch (options.storage) {
+    case StorageKind::Lines: storage = std::make_unique<LineStorage>(); break;
+    case StorageKind::Arena: storage = std::make_unique<ArenaStorage>(options.intern); break;
+    case StorageKind::PieceTable: storage = std::make_unique<PieceTableStorage>(); break;
+    case StorageKind::Rope: storage = std::make_unique<RopeStorage>(); break;
+    case StorageKind::Mapped: storage = std::make_unique<MappedStorage>(); break;
+    case StorageKind::Paged: storage = std::make_unique<PagedStorage>(); break;
+    }
+    storage->setIndexThreads(options.indexThreads);
+    return storage;
+}
+
+bool parseStorageKind(const std::string& name, StorageKind& kind) {
+    if (name == "lines") kind = StorageKind::Lines;
+    else if (name == "arena") kind = StorageKind::Arena;
+    else if (name == "piece") kind = StorageKind::PieceTable;
+    else if (name == "rope") kind = StorageKind::Rope;
+    else if (name == "mmap") kind = StorageKind::Mapped;
+    else if (name == "paged") kind = StorageKind::Paged;
+    else return false;
+    return true;
+}
+
+UndoLog::UndoLog(size_t budget, bool journaled) : budget(budget), journaled(journaled) {}
+
+size_t UndoLog::journalMemory() const {
+    return heapBytes(journal);
+}
+
+size_t UndoLog::cost(const Entry& entry) {
+    return sizeof(Entry) + entry.removed.capacity() + entry.inserted.capacity();
+}
+
+// Typing and backspacing extend the newest entry while they stay adjacent
+// and arrive within CoalesceWindow of each other, so a burst of keystrokes
+// undoes as one step.
+void UndoLog::record(size_t offset, const std::string& removed, const std::string& inserted, bool joined) {
+    auto now = std::chrono::steady_clock::now();
+    clearRedo();
+    if (open && !joined && now - undoStack.back().time < CoalesceWindow) {
+        Entry& last = undoStack.back();
+        bool typing = removed.empty() && last.removed.empty() && offset == last.offset + last.inserted.size();
+        bool backspace = inserted.empty() && last.inserted.empty() && offset + removed.size() == last.offset;
+        bool forwardDelete = inserted.empty() && last.inserted.empty() && offset == last.offset;
+        if (typing || backspace || forwardDelete) {
+            bytes -= cost(last);
+            if (typing) last.inserted += inserted;
+            else if (backspace) last.removed.insert(0, removed), last.offset = offset;
+            else last.removed += removed;
+            last.time = now;
+            bytes += cost(last);
+            trim();
+            return;
+        }
+    }
+    seal();
+    undoStack.push_back({offset, removed, inserted, now, joined});
+    bytes += cost(undoStack.back());
+    open = true;
+    trim();
+}
+
+bool UndoLog::popUndo(Entry& entry) {
+    if (undoStack.empty()) return false;
+    seal();
+    note(UndoRecord::Undo);
+    redoStack.push_back(std::move(undoStack.back()));
+    undoStack.pop_back();
+    entry = redoStack.back();
+    return true;
+}
+
+bool UndoLog::popRedo(Entry& entry) {
+    if (redoStack.empty()) return false;
+    note(UndoRecord::Redo);
+    undoStack.push_back(std::move(redoStack.back()));
+    redoStack.pop_back();
+    entry = undoStack.back();
+    return true;
+}
+
+void UndoLog::seal() {
+    if (open && journaled && !dropped) {
+        appendEntryRecord(journal, undoStack.back());
+        limitJournal();
+    }
+    open = false;
+}
+
+void UndoLog::note(char record) {
+    if (!journaled || dropped) return;
+    journal += record;
+    limitJournal();
+}
+
+// Past the budget the journal is worth less than rewriting the undo file
+// from the history, which trim() keeps within it.
+void UndoLog::limitJournal() {
+    if (journal.size() <= budget) return;
+    std::string().swap(journal);
+    dropped = true;
+}
+
+void UndoLog::clearRedo() {
+    for (const auto& entry : redoStack) bytes -= cost(entry);
+    redoStack.clear();
+}
+
+// Drops whole steps only, so a batch never loses some of its parts.
+void UndoLog::trim() {
+    while (bytes > budget && !undoStack.empty()) {
+        do {
+            if (undoStack.size() == 1) seal();
+            note(UndoRecord::Trim);
+            bytes -= cost(undoStack.front());
+            undoStack.pop_front();
+        } while (!undoStack.empty() && undoStack.front().joined);
     }
-    return result;
 }
 
-Buffer::Buffer(const std::string& path) : filepath(path) {
+std::string UndoLog::takeJournal(size_t len) {
+    std::string taken = journal.substr(0, len);
+    journal.erase(0, len);
+    return taken;
+}
+
+void UndoLog::restartJournal() {
+    std::string().swap(journal);
+    dropped = false;
+}
+
+void UndoLog::setJournaled(bool on) {
+    journaled = on;
+    if (!on) std::string().swap(journal);
+}
+
+// Redo entries are written as edits followed by as many undos, which
+// leaves them on the redo stack in their original order.
+std::string UndoLog::serialize() const {
+    std::string records(UndoMagic, sizeof(UndoMagic));
+    for (const auto& entry : undoStack) appendEntryRecord(records, entry);
+    for (auto it = redoStack.rbegin(); it != redoStack.rend(); ++it) appendEntryRecord(records, *it);
+    records.append(redoStack.size(), UndoRecord::Undo);
+    return records;
+}
+
+void UndoLog::replay(const char* data, size_t len) {
+    *this = UndoLog(budget, journaled);
+    UndoRecordReader reader{data, len};
+    Entry entry;
+    for (char kind; reader.next(kind, &entry);) {
+        if (kind == UndoRecord::Edit || kind == UndoRecord::Joined) {
+            entry.joined = kind == UndoRecord::Joined;
+            clearRedo();
+            undoStack.push_back(std::move(entry));
+            bytes += cost(undoStack.back());
+        } else if (kind == UndoRecord::Undo && !undoStack.empty()) {
+            redoStack.push_back(std::move(undoStack.back()));
+            undoStack.pop_back();
+        } else if (kind == UndoRecord::Redo && !redoStack.empty()) {
+            undoStack.push_back(std::move(redoStack.back()));
+            redoStack.pop_back();
+        } else if (kind == UndoRecord::Trim && !undoStack.empty()) {
+            bytes -= cost(undoStack.front());
+            undoStack.pop_front();
+        }
+    }
+    trim();
+}
+
+Buffer::Buffer(const BufferOptions& options)
+    : storage(makeStorage(options)), options(options), layout(options.storage), history(options.undoBudget, false) {}
+
+Buffer::Buffer(const std::string& path, const BufferOptions& options)
+    : storage(makeStorage(options)), options(options), layout(options.storage), filepath(path),
+      history(options.undoBudget, options.persistUndo && !path.empty()) {
     load();
 }
 
+void Buffer::recordEdit(size_t offset, const std::string& removed, const std::string& inserted) {
+    dirty.erased(offset, removed.size());
+    dirty.inserted(offset, inserted.size());
+    history.record(offset, removed, inserted);
+    touch();
+    limitLineLength(offset, inserted.size());
+}
+
+void Buffer::limitLineLength(size_t offset, size_t len) {
+    if (layout != StorageKind::Lines && layout != StorageKind::Arena) return;
+    size_t last = storage->rowAt(offset + len);
+    for (size_t row = storage->rowAt(offset); row <= last; row++) {
+        if (storage->lineLength(row) < LongLineThreshold) continue;
+        BufferOptions ropeOptions = options;
+        ropeOptions.storage = layout = StorageKind::Rope;
+        auto rope = makeStorage(ropeOptions);
+        rope->assign(storage->read(0, storage->size()));
+        storage = std::move(rope);
+        return;
+    }
+}
+
+TextStorage& Buffer::mutableStorage() {
+    if (storage.use_count() > 1) storage = storage->clone();
+    else std::atomic_thread_fence(std::memory_order_acquire);
+    return *storage;
+}
+
+// A clone is read by its holder's thread while const calls update its
+// lazy state, so its size is taken now; shared storage is measured later.
+BufferSnapshot Buffer::snapshot() const {
+    handedOut.erase(std::remove_if(handedOut.begin(), handedOut.end(), [](const auto& h) { return h.first.expired(); }),
+                    handedOut.end());
+    if (storage->concurrentReads()) {
+        if (handedOut.empty() || handedOut.back().first.lock() != storage) handedOut.emplace_back(storage, SIZE_MAX);
+        return BufferSnapshot(storage, version);
+    }
+    std::shared_ptr<const TextStorage> copy = storage->clone();
+    handedOut.emplace_back(copy, copy->memoryUsage());
+    return BufferSnapshot(std::move(copy), version);
+}
+
+MemoryUsage Buffer::memoryUsage() const {
+    MemoryUsage usage;
+    usage.text = storage->textMemory();
+    usage.index = storage->indexMemory();
+    usage.undo = history.memoryUsage() + history.journalMemory();
+    std::vector<const TextStorage*> counted{storage.get()};
+    for (const auto& [handed, size] : handedOut) {
+        auto held = handed.lock();
+        if (!held || std::find(counted.begin(), counted.end(), held.get()) != counted.end()) continue;
+        counted.push_back(held.get());
+        usage.snapshots += size == SIZE_MAX ? held->memoryUsage() : size;
+    }
+    return usage;
+}
+
+void Buffer::positionOf(size_t offset, int& row, int& col) const {
+    row = storage->rowAt(offset);
+    col = std::min(offset - storage->offsetOf(row), storage->lineLength(row));
+}
+
+void Buffer::replaceAt(size_t offset, size_t len, const std::string& text) {
+    size_t row = storage->rowAt(offset);
+    size_t col = offset - storage->offsetOf(row);
+    TextStorage& target = mutableStorage();
+    target.erase(row, col, len);
+    target.insert(row, col, text);
+    dirty.erased(offset, len);
+    dirty.inserted(offset, text.size());
+    touch();
+    limitLineLength(offset, text.size());
+}
+
 void Buffer::insertChar(int row, int col, char c) {
-    if (row >= lines.size()) return;
-    lines[row].insert(col, 1, c);
-    modified = true;
+    if (!hasLine(row) || col < 0 || size_t(col) > storage->lineLength(row)) return;
+    std::string text(1, c);
+    mutableStorage().insert(row, col, text);
+    recordEdit(storage->offsetOf(row) + col, "", text);
 }
 
 void Buffer::deleteChar(int row, int col) {
-    if (row >= lines.size() || col == 0) return;
-    lines[row].erase(col - 1, 1);
-    modified = true;
+    if (!hasLine(row) || col <= 0 || size_t(col) > storage->lineLength(row)) return;
+    std::string removed = storage->read(row, col - 1, 1);
+    mutableStorage().erase(row, col - 1, 1);
+    recordEdit(storage->offsetOf(row) + col - 1, removed, "");
 }
 
 void Buffer::insertLine(int row) {
-    if (row > lines.size()) return;
-    lines.insert(lines.begin() + row + 1, "");
-    modified = true;
+    if (!hasLine(row)) return;
+    size_t len = storage->lineLength(row);
+    mutableStorage().insert(row, len, "\n");
+    recordEdit(storage->offsetOf(row) + len, "", "\n");
 }
 
 void Buffer::deleteLine(int row) {
-    if (lines.size() <= 1) return;
-    lines.erase(lines.begin() + row);
-    modified = true;
+    if (!hasLine(row) || !hasLine(1)) return;
+    size_t len = storage->lineLength(row) + 1;
+    if (hasLine(row + 1)) {
+        std::string removed = storage->read(row, 0, len);
+        size_t offset = storage->offsetOf(row);
+        mutableStorage().erase(row, 0, len);
+        recordEdit(offset, removed, "");
+    } else {
+        size_t col = storage->lineLength(row - 1);
+        std::string removed = storage->read(row - 1, col, len);
+        size_t offset = storage->offsetOf(row - 1) + col;
+        mutableStorage().erase(row - 1, col, len);
+        recordEdit(offset, removed, "");
+    }
+}
+
+void Buffer::splitLine(int row, int col) {
+    if (!hasLine(row) || col < 0 || size_t(col) > storage->lineLength(row)) return;
+    mutableStorage().insert(row, col, "\n");
+    recordEdit(storage->offsetOf(row) + col, "", "\n");
+}
+
+bool Buffer::undo(int& row, int& col) {
+    UndoLog::Entry entry;
+    if (!history.popUndo(entry)) return false;
+    replaceAt(entry.offset, entry.inserted.size(), entry.removed);
+    while (entry.joined && history.popUndo(entry)) replaceAt(entry.offset, entry.inserted.size(), entry.removed);
+    positionOf(entry.offset, row, col);
+    return true;
+}
+
+bool Buffer::redo(int& row, int& col) {
+    UndoLog::Entry entry;
+    if (!history.popRedo(entry)) return false;
+    replaceAt(entry.offset, entry.removed.size(), entry.inserted);
+    while (history.redoJoined() && history.popRedo(entry)) replaceAt(entry.offset, entry.removed.size(), entry.inserted);
+    positionOf(entry.offset + entry.inserted.size(), row, col);
+    return true;
+}
+
+bool Buffer::applyEdits(std::vector<Edit> edits) {
+    return applyBatch(std::move(edits), true);
+}
+
+// The edits are recorded highest offset first, as they were applied, so
+// undoing them from the top of the stack replays the batch in reverse.
+bool Buffer::applyBatch(std::vector<Edit> edits, bool record) {
+    // Pure insertions sort ahead of a replacement starting at the same offset.
+    auto before = [](const Edit& a, const Edit& b) {
+        return a.offset != b.offset ? a.offset < b.offset : (a.length == 0 && b.length != 0);
+    };
+    if (!std::is_sorted(edits.begin(), edits.end(), before)) std::stable_sort(edits.begin(), edits.end(), before);
+    size_t end = 0, total = storage->size();
+    for (const auto& edit : edits) {
+        if (edit.offset < end || edit.length > total || edit.offset > total - edit.length) return false;
+        end = edit.offset + edit.length;
+    }
+    edits.erase(std::remove_if(edits.begin(), edits.end(), [](const Edit& e) { return e.length == 0 && e.text.empty(); }),
+                edits.end());
+    if (edits.empty()) return true;
+
+    std::vector<std::string> removed = mutableStorage().apply(edits);
+    dirty.applied(edits);
+    if (record) {
+        history.breakGroup();
+        for (size_t i = edits.size(); i-- > 0;) {
+            history.record(edits[i].offset, removed[i], edits[i].text, i + 1 < edits.size());
+        }
+        history.breakGroup();
+    }
+    touch();
+    size_t shift = 0;
+    for (const auto& edit : edits) {
+        limitLineLength(edit.offset + shift, edit.text.size());
+        shift += edit.text.size() - edit.length;
+    }
+    return true;
 }
 
 std::string Buffer::getLine(int row) const {
-    if (row >= lines.size()) return "";
-    return lines[row];
+    if (!hasLine(row)) return "";
+    return storage->line(row);
 }
 
-void Buffer::save() {
-    std::ofstream file(filepath);
-    for (const auto& line : lines) {
-        file << line << '\n';
+std::string Buffer::getLine(int row, int col, int len) const {
+    if (!hasLine(row) || col < 0 || len <= 0) return "";
+    return storage->line(row, col, len);
+}
+
+std::string_view Buffer::getLineView(int row, int col, int len, std::string& scratch) const {
+    if (!hasLine(row) || col < 0 || len <= 0) return {};
+    return storage->lineView(row, col, len, scratch);
+}
+
+SaveStats Buffer::save() {
+    SaveRequest request = prepareSave(false);
+    try {
+        SaveStats stats = performSave(request, nullptr);
+        finishSave(request, true);
+        return stats;
+    } catch (...) {
+        finishSave(request, false);
+        throw;
     }
-    modified = false;
 }
 
-void Buffer::load() {
-    lines.clear();
-    std::ifstream file(filepath);
-    if (!file.is_open()) {
-        lines.push_back("");
+// Patching in place is only planned for files big enough to matter, when
+// the file is still the one we last loaded or wrote, and when the patch is
+// a small part of it. Storage that reads from the file itself additionally
+// needs every untouched byte to stay put, and every '\n', which the save
+// checks against the file before it writes.
+SaveRequest Buffer::prepareSave(bool detach) {
+    SaveRequest request;
+    request.snapshot = detach ? snapshot().text() : storage;
+    request.path = filepath;
+    request.version = version;
+    history.breakGroup();
+    request.journal = history.journalSize();
+    if (!storage->readsFromFile() && image.known) {
+        request.image = image;
+        request.changes = dirty;
+    }
+    if (disk.valid && disk.size >= InPlaceMinFileSize && stampFile(filepath) == disk) {
+        bool shifted;
+        request.fileSize = disk.size + dirty.sizeDelta();
+        auto patches = dirty.regions(request.fileSize, shifted);
+        size_t bytes = 0;
+        for (auto [begin, end] : patches) bytes += end - begin;
+        if (bytes <= disk.size / 4 && !(shifted && storage->readsFromFile())) {
+            request.inPlace = true;
+            request.patches = std::move(patches);
+            request.expected = disk;
+            request.keepNewlines = storage->readsFromFile();
+        }
+    }
+    dirty.clear();
+    return request;
+}
+
+void Buffer::finishSave(const SaveRequest& request, bool saved, DiskImage scanned) {
+    if (!saved) {
+        disk.valid = false;
+        image = DiskImage{};
         return;
     }
-    std::string line;
-    while (std::getline(file, line)) {
-        lines.push_back(line);
+    if (storage->readsFromFile()) image = DiskImage{stampFile(request.path), {}, false};
+    else if (scanned.known) image = std::move(scanned);
+    else if (request.image.known) image = imageAfterSave(request);
+    else image = scanFile(request.path, options.indexThreads);
+    disk = stampFile(request.path);
+    if (request.version == version) modified = false;
+    saveHistory(request);
+    if (tail.isOpen()) {
+        // A rewrite replaces the file, so the tail moves to the new one.
+        newlinePending = false;
+        tail.open(request.path, request.snapshot->size());
+    }
+}
+
+// Appends the operations up to the saved text plus a checkpoint for the new
+// file. A missing or stale undo file, or one that has grown well past the
+// history it holds, is rewritten instead, which is only possible while the
+// history still matches the saved text. History is a convenience: failing
+// to write it never fails the save.
+void Buffer::saveHistory(const SaveRequest& request) {
+    if (!options.persistUndo || filepath.empty()) return;
+    std::string path = undoFilePath(filepath);
+    std::string records = history.takeJournal(request.journal);
+    bool rewrite = undoFileSize == 0 || !history.journalComplete() ||
+                   undoFileSize > 4 * history.memoryUsage() + (1 << 20);
+    try {
+        if (rewrite) {
+            if (request.version != version) {
+                undoFileSize = 0;
+                return;
+            }
+            records = history.serialize();
+            appendCheckpointRecord(records, disk);
+            AtomicFileWriter writer(path);
+            writer.write(records.data(), records.size());
+            writer.commit();
+            undoFileSize = records.size();
+            history.restartJournal();
+        } else {
+            appendCheckpointRecord(records, disk);
+            writeUndoRecords(path, undoFileSize, records);
+            undoFileSize += records.size();
+        }
+    } catch (const std::exception&) {
+        undoFileSize = 0;
+    }
+}
+
+// A new path starts a new undo file, written whole on the next save.
+void Buffer::setFilepath(const std::string& path) {
+    filepath = path;
+    undoFileSize = 0;
+    history.setJournaled(options.persistUndo && !path.empty());
+}
+
+// Restores the history saved with the file, provided the file is still the
+// one the last checkpoint describes.
+void Buffer::loadHistory() {
+    history = UndoLog(options.undoBudget, options.persistUndo && !filepath.empty());
+    undoFileSize = 0;
+    if (!options.persistUndo || filepath.empty()) return;
+    MappedFile file(undoFilePath(filepath));
+    if (file.size() < sizeof(UndoMagic) || std::memcmp(file.data(), UndoMagic, sizeof(UndoMagic)) != 0) return;
+    UndoRecordReader reader{file.data(), file.size(), sizeof(UndoMagic)};
+    FileStamp checkpoint;
+    size_t end = reader.lastCheckpoint(checkpoint);
+    if (end == 0 || !(checkpoint == disk)) return;
+    history.replay(file.data() + sizeof(UndoMagic), end - sizeof(UndoMagic));
+    undoFileSize = end;
+}
+
+SaveJob::SaveJob(std::shared_ptr<Buffer> buffer) : buffer(buffer), request(buffer->prepareSave(true)) {
+    worker = std::thread([this] {
+        try {
+            stats = performSave(request, &written);
+            if (request.image.known) scanned = imageAfterSave(request);
+            else if (!request.snapshot->readsFromFile()) scanned = scanFile(request.path);
+        } catch (const std::exception& e) {
+            error = e.what();
+        }
+        finished = true;
+    });
+}
+
+SaveJob::~SaveJob() {
+    if (worker.joinable()) worker.join();
+}
+
+std::string SaveJob::finish() {
+    worker.join();
+    buffer->finishSave(request, error.empty(), std::move(scanned));
+    if (!error.empty()) return "Save failed: " + error;
+    std::string message = std::string(stats.inPlace ? "Patched in place: " : "File saved: ") +
+                          formatBytes(stats.bytes) + " in " + formatSeconds(stats.seconds);
+    if (stats.seconds > 0) message += " (" + formatBytes(stats.bytes / stats.seconds) + "/s)";
+    return message;
+}
+
+// Storage that reads from the file itself cannot be patched from it once it
+// changes, so only the stamp is kept for it. Other storage is handed the
+// text read here, which is chunked on the way.
+void Buffer::load() {
+    if (storage.use_count() > 1 || layout != options.storage) {
+        storage = makeStorage(options);
+        layout = options.storage;
+    }
+    image = DiskImage{stampFile(filepath), {}, false};
+    if (options.storage == StorageKind::Mapped || options.storage == StorageKind::Paged) {
+        storage->load(filepath);
+    } else {
+        std::string text = readText(filepath);
+        image.chunks = chunkText(text, options.indexThreads);
+        image.known = image.stamp.valid && stampFile(filepath) == image.stamp;
+        storage->assign(std::move(text));
+    }
+    // Only line and arena storage are limited, and only for them is the
+    // size cheap to take: the overlays would index the whole file for it.
+    if (layout == StorageKind::Lines || layout == StorageKind::Arena) limitLineLength(0, storage->size());
+    modified = false;
+    dirty.clear();
+    // The file only matches the document byte for byte if it already ends
+    // with the newline that save() appends.
+    disk = stampFile(filepath);
+    char last = 0;
+    int fd = open(filepath.c_str(), O_RDONLY);
+    if (fd >= 0) {
+        if (disk.size == 0 || pread(fd, &last, 1, disk.size - 1) != 1) last = 0;
+        close(fd);
+    }
+    disk.valid = disk.valid && last == '\n';
+    loadHistory();
+}
+
+DiskChange Buffer::syncWithDisk() {
+    FileStamp now = stampFile(filepath);
+    if (filepath.empty() || !now.valid || now == image.stamp) return DiskChange::None;
+    if (!image.known || storage->readsFromFile()) {
+        if (!modified) {
+            load();
+            return DiskChange::Reloaded;
+        }
+        detachFromFile();
+        return DiskChange::Conflict;
+    }
+    // Read rather than mapped: the file may be truncated while it is read.
+    DiskImage scanned;
+    scanned.stamp = now;
+    std::string text = readText(filepath);
+    bool newline = now.size == text.size() + 1;
+    scanned.chunks = chunkText(text, options.indexThreads);
+    if (!(stampFile(filepath) == now)) return DiskChange::None;  // still being written; wait for the next event
+    scanned.known = true;
+
+    std::vector<Edit> edits = diffChunks(image.chunks, scanned.chunks, text);
+    if (!dirty.fromDisk(edits)) return DiskChange::Conflict;
+    bool wasModified = modified;
+    // The merge is recorded only to keep existing history in step with
+    // the text; with none there is nothing it could be undone back to.
+    bool record = !history.empty();
+    // The merged edits are in the file already; only the unsaved ranges
+    // after them move.
+    DirtyRanges unsaved = dirty;
+    unsaved.moved(edits);
+    if (!edits.empty()) applyBatch(std::move(edits), record);
+    dirty = std::move(unsaved);
+    image = std::move(scanned);
+    disk = now;
+    disk.valid = newline;
+    if (!wasModified) {
+        modified = false;
+        dirty.clear();
+        // The document is the file again; a history worth keeping gets a
+        // checkpoint for the new file so it survives a restart.
+        if (record) {
+            SaveRequest request;
+            request.version = version;
+            request.journal = history.journalSize();
+            saveHistory(request);
+        }
+    }
+    return DiskChange::Merged;
+}
+
+void Buffer::detachFromFile() {
+    if (storage->readsFromFile()) mutableStorage().detach();
+}
+
+// The document, less its unsaved edits, is a prefix of the file, so the
+// tail starts there: bytes appended since then, and the final newline held
+// back from the document, come in with the first read.
+bool Buffer::follow() {
+    if (filepath.empty() || syncWithDisk() == DiskChange::Conflict) return false;
+    newlinePending = false;
+    return tail.open(filepath, storage->size() - dirty.sizeDelta());
+}
+
+void Buffer::appendText(std::string text) {
+    if (newlinePending) text.insert(text.begin(), '\n');
+    newlinePending = text.back() == '\n';
+    if (newlinePending) text.pop_back();
+    // Only line and arena storage are limited, and only for them is the
+    // size cheap to take.
+    bool limited = layout == StorageKind::Lines || layout == StorageKind::Arena;
+    size_t end = limited ? storage->size() : 0;
+    mutableStorage().append(text);
+    version++;
+    if (limited) limitLineLength(end, text.size());
+}
+
+DiskChange Buffer::readAppended() {
+    std::string text;
+    if (stream) {
+        stream->take(text, FollowReadLimit);
+        if (stream->finished()) stream.reset();
+        if (text.empty()) return DiskChange::None;
+        appendText(std::move(text));
+        return DiskChange::Merged;
+    }
+    if (!tail.isOpen()) return DiskChange::None;
+    if (!tail.read(text, FollowReadLimit)) {
+        tail.close();
+        if (modified) {
+            detachFromFile();
+            return DiskChange::Conflict;
+        }
+        load();
+        newlinePending = false;
+        tail.open(filepath, storage->size());
+        return DiskChange::Reloaded;
     }
-    if (lines.empty()) lines.push_back("");
+    if (text.empty()) return DiskChange::None;
+    appendText(std::move(text));
+    // The chunks no longer describe the file; a later change to it is
+    // reloaded rather than merged.
+    image = DiskImage{tail.stamp(), {}, false};
+    disk = image.stamp;
+    disk.valid = disk.valid && newlinePending;
+    return DiskChange::Merged;
+}
+
+std::string formatBytes(double bytes) {
+    const char* units[] = {"B", "KiB", "MiB", "GiB", "TiB"};
+    int unit = 0;
+    for (; bytes >= 1024 && unit < 4; unit++) bytes /= 1024;
+    char buf[32];
+    snprintf(buf, sizeof buf, unit ? "%.1f %s" : "%.0f %s", bytes, units[unit]);
+    return buf;
+}
+
+std::string formatSeconds(double seconds) {
+    char buf[32];
+    snprintf(buf, sizeof buf, "%.2f s", seconds);
+    return buf;
 }
 
 void PluginManager::loadPlugin(std::shared_ptr<Plugin> plugin) {
@@ -147,9 +4039,10 @@ void PluginManager::notifyKeyPress(int key) {
     }
 }
 
-void PluginManager::notifyBufferChange() {
+void PluginManager::notifyBufferChange(const Buffer& buffer) {
     for (auto& [name, plugin] : plugins) {
         plugin->onBufferChange();
+        plugin->onBufferEdited(buffer);
     }
 }
 
@@ -183,7 +4076,10 @@ std::string FileExplorer::getSelected() const {
 
 Editor::Editor() {
     Terminal::enterRawMode();
-    buffers.push_back(std::make_shared<Buffer>());
+    View view;
+    view.buffer = std::make_shared<Buffer>();
+    buffers.push_back(std::move(view));
+    buffers.back().lastShown = ++showCount;
     
     highlighter.addRule(R"(\b(int|void|return|if|else|for|while|class)\b)", "\x1b[34m");
     highlighter.addRule(R"(".*?")", "\x1b[32m");
@@ -191,17 +4087,20 @@ Editor::Editor() {
 }
 
 Editor::~Editor() {
+    waitForSave();
     Terminal::exitRawMode();
 }
 
 void Editor::run() {
     while (running) {
+        pollSave();
+        pollDisk();
         render();
-        processKeypress();
+        processKeyPress();
     }
 }
 
-void Editor::processKeypress() {
+void Editor::processKeyPress() {
     char c;
     if (read(STDIN_FILENO, &c, 1) != 1) return;
     
@@ -226,8 +4125,13 @@ void Editor::processKeypress() {
     if (c == ':') {
         commandMode = true;
     } else if (c == 27) {
+        clearCursors();
     } else if (c == 127) {
         deleteChar();
+    } else if (c == 26) {
+        undo();
+    } else if (c == 25) {
+        redo();
     } else if (c == '\r') {
         newLine();
     } else if (c >= 32 && c <= 126) {
@@ -236,55 +4140,421 @@ void Editor::processKeypress() {
 }
 
 void Editor::insertChar(char c) {
+    if (!cursors.empty()) return editAtCursors(std::string(1, c), false);
     getCurrentBuffer().insertChar(cursorRow, cursorCol, c);
     cursorCol++;
-    pluginManager.notifyBufferChange();
+    pluginManager.notifyBufferChange(getCurrentBuffer());
 }
 
 void Editor::deleteChar() {
-    if (cursorCol > 0) {
+    if (!cursors.empty()) {
+        editAtCursors("", true);
+    } else if (cursorCol > 0) {
         getCurrentBuffer().deleteChar(cursorRow, cursorCol);
         cursorCol--;
-        pluginManager.notifyBufferChange();
+        pluginManager.notifyBufferChange(getCurrentBuffer());
     }
 }
 
 void Editor::newLine() {
-    std::string& line = getCurrentBuffer().getLine(cursorRow);
-    std::string rest = line.substr(cursorCol);
-    line = line.substr(0, cursorCol);
-    getCurrentBuffer().insertLine(cursorRow);
+    if (!cursors.empty()) return editAtCursors("\n", false);
+    getCurrentBuffer().splitLine(cursorRow, cursorCol);
     cursorRow++;
     cursorCol = 0;
-    pluginManager.notifyBufferChange();
+    pluginManager.notifyBufferChange(getCurrentBuffer());
+}
+
+void Editor::undo() {
+    clearCursors();
+    if (getCurrentBuffer().undo(cursorRow, cursorCol)) pluginManager.notifyBufferChange(getCurrentBuffer());
+    else statusMessage = "Nothing to undo";
+}
+
+void Editor::redo() {
+    clearCursors();
+    if (getCurrentBuffer().redo(cursorRow, cursorCol)) pluginManager.notifyBufferChange(getCurrentBuffer());
+    else statusMessage = "Nothing to redo";
+}
+
+void Editor::applyEdits(std::vector<Edit> edits) {
+    if (getCurrentBuffer().applyEdits(std::move(edits))) pluginManager.notifyBufferChange(getCurrentBuffer());
+    else statusMessage = "Overlapping edits";
+}
+
+// One batched edit for all cursors: each erases the character before it
+// (within its line, like a single cursor) or inserts `text`. Cursors are
+// sorted, so the edits are too and the new offsets come out of one pass.
+void Editor::editAtCursors(const std::string& text, bool backspace) {
+    Buffer& buffer = getCurrentBuffer();
+    size_t primary = buffer.offsetOf(cursorRow, cursorCol);
+    auto at = std::lower_bound(cursors.begin(), cursors.end(), primary);
+    if (at == cursors.end() || *at != primary) at = cursors.insert(at, primary);
+    size_t index = at - cursors.begin();
+    std::vector<Edit> edits;
+    edits.reserve(cursors.size());
+    {
+        // Backspace leaves cursors at the start of a line alone. Those are
+        // found in the same pass over the sorted cursors by looking for a
+        // newline before each one, reusing the span read for the cursor
+        // before it. The reader holds the storage, so it is gone before the
+        // edits are applied.
+        ChunkCursor reader = buffer.chunks();
+        std::string_view span;
+        size_t spanStart = 0;
+        for (size_t offset : cursors) {
+            bool erase = false;
+            if (backspace && offset > 0) {
+                if (offset - 1 < spanStart || offset - 1 >= spanStart + span.size()) {
+                    reader = buffer.chunks(offset - 1);
+                    spanStart = offset - 1;
+                    if (!reader.next(span)) span = {};
+                }
+                erase = offset - 1 < spanStart + span.size() && span[offset - 1 - spanStart] != '\n' &&
+                        (edits.empty() || offset > edits.back().offset + edits.back().length);
+            }
+            edits.push_back(erase ? Edit{offset - 1, 1, ""} : Edit{offset, 0, text});
+        }
+    }
+    if (!buffer.applyEdits(edits)) return;
+
+    size_t shift = 0;
+    for (size_t i = 0; i < cursors.size(); i++) {
+        cursors[i] = edits[i].offset + edits[i].text.size() + shift;
+        shift += edits[i].text.size() - edits[i].length;
+    }
+    primary = cursors[index];
+    cursors.erase(std::unique(cursors.begin(), cursors.end()), cursors.end());
+    if (cursors.size() == 1) cursors.clear();
+    buffer.positionOf(primary, cursorRow, cursorCol);
+    pluginManager.notifyBufferChange(buffer);
+}
+
+// Adds a cursor at the start of every occurrence of `text`.
+void Editor::addCursors(const std::string& text) {
+    if (text.empty()) return;
+    Buffer& buffer = getCurrentBuffer();
+    std::vector<size_t> found;
+    std::string scratch;
+    for (int row = 0; buffer.hasLine(row); row++) {
+        std::string_view line = buffer.getLineView(row, scratch);
+        for (size_t col = line.find(text); col != std::string_view::npos; col = line.find(text, col + text.size())) {
+            found.push_back(buffer.offsetOf(row, col));
+        }
+    }
+    if (cursors.empty()) cursors.push_back(buffer.offsetOf(cursorRow, cursorCol));
+    size_t middle = cursors.size();
+    cursors.insert(cursors.end(), found.begin(), found.end());
+    std::inplace_merge(cursors.begin(), cursors.begin() + middle, cursors.end());
+    cursors.erase(std::unique(cursors.begin(), cursors.end()), cursors.end());
+    if (cursors.size() == 1) cursors.clear();
+    statusMessage = std::to_string(std::max<size_t>(cursors.size(), 1)) + " cursor" + (cursors.size() > 1 ? "s" : "");
+}
+
+void Editor::clearCursors() {
+    cursors.clear();
+}
+
+void Editor::replaceAll(const std::string& from, const std::string& to) {
+    if (from.empty()) return;
+    Buffer& buffer = getCurrentBuffer();
+    std::vector<Edit> edits;
+    std::string scratch;
+    for (int row = 0; buffer.hasLine(row); row++) {
+        std::string_view line = buffer.getLineView(row, scratch);
+        for (size_t col = line.find(from); col != std::string_view::npos; col = line.find(from, col + from.size())) {
+            edits.push_back(Edit{buffer.offsetOf(row, col), from.size(), to});
+        }
+    }
+    size_t count = edits.size();
+    if (count > 0) applyEdits(std::move(edits));
+    statusMessage = "Replaced " + std::to_string(count) + " occurrence" + (count == 1 ? "" : "s");
 }
 
 void Editor::executeCommand(const std::string& cmd) {
     if (cmd == "q") quit();
     else if (cmd == "w") saveFile();
-    else if (cmd == "wq") { saveFile(); quit(); }
+    else if (cmd == "wq") { if (saveFile()) { waitForSave(); quit(); } }
+    else if (cmd == "undo") undo();
+    else if (cmd == "redo") redo();
+    else if (cmd == "follow") toggleFollow();
+    else if (cmd == "mem") reportMemory("");
+    else if (cmd.substr(0, 4) == "mem ") reportMemory(cmd.substr(4));
+    else if (cmd.substr(0, 8) == "replace ") {
+        std::string args = cmd.substr(8);
+        size_t space = args.find(' ');
+        replaceAll(args.substr(0, space), space == std::string::npos ? "" : args.substr(space + 1));
+    }
+    else if (cmd.substr(0, 8) == "cursors ") addCursors(cmd.substr(8));
     else if (cmd.substr(0, 2) == "e ") openFile(cmd.substr(2));
+    else if (cmd == "bn") showBuffer((currentBuffer + 1) % buffers.size());
+    else if (cmd == "bp") showBuffer((currentBuffer + buffers.size() - 1) % buffers.size());
+    else if (cmd.substr(0, 2) == "b ") {
+        size_t n = std::strtoul(cmd.c_str() + 2, nullptr, 10);
+        if (n >= 1 && n <= buffers.size()) showBuffer(n - 1);
+        else statusMessage = "No buffer " + cmd.substr(2);
+    }
     else if (cmd == "explorer") { showExplorer = !showExplorer; fileExplorer.scanDirectory("."); }
     else statusMessage = "Unknown command: " + cmd;
 }
 
-void Editor::openFile(const std::string& filepath) {
-    buffers.push_back(std::make_shared<Buffer>(filepath));
-    currentBuffer = buffers.size() - 1;
-    cursorRow = cursorCol = 0;
+void Editor::openFile(const std::string& filepath, bool show) {
+    for (size_t i = 0; i < buffers.size(); i++) {
+        if (buffers[i].path != filepath) continue;
+        if (show) showBuffer(i);
+        return;
+    }
+    View view;
+    view.path = filepath;
+    buffers.push_back(std::move(view));
+    watcher.watch(filepath);
+    if (show) showBuffer(buffers.size() - 1);
+}
+
+void Editor::openStream(int fd) {
+    auto buffer = std::make_shared<Buffer>(bufferOptions);
+    buffer->streamFrom(fd);
+    View view;
+    view.buffer = std::move(buffer);
+    buffers.push_back(std::move(view));
+    showBuffer(buffers.size() - 1);
 }
 
-void Editor::saveFile() {
-    getCurrentBuffer().save();
-    statusMessage = "File saved";
+void Editor::showBuffer(int index) {
+    View& from = buffers[currentBuffer];
+    from.cursorRow = cursorRow;
+    from.cursorCol = cursorCol;
+    from.rowOffset = rowOffset;
+    from.colOffset = colOffset;
+    currentBuffer = index;
+    View& view = buffers[index];
+    if (!view.buffer) view.buffer = std::make_shared<Buffer>(view.path, bufferOptions);
+    view.lastShown = ++showCount;
+    cursorRow = view.cursorRow;
+    cursorCol = view.cursorCol;
+    rowOffset = view.rowOffset;
+    colOffset = view.colOffset;
+    clearCursors();
+    clampCursor();
+    evictBuffers();
 }
 
-void Editor::quit() {
-    if (getCurrentBuffer().isModified()) {
-        statusMessage = "Unsaved changes! Use :q! to force quit";
+// Sizes are remeasured only for buffers that changed since the last call,
+// which inactive ones rarely do. Buffers that cannot be reloaded as they
+// are, because they have unsaved edits, no file, or history that exists
+// only in memory, are never evicted.
+void Editor::evictBuffers() {
+    size_t total = 0;
+    for (auto& view : buffers) {
+        if (!view.buffer) continue;
+        if (view.measured != view.buffer->getVersion()) {
+            view.bytes = view.buffer->memoryUsage().total();
+            view.measured = view.buffer->getVersion();
+        }
+        total += view.bytes;
+    }
+    while (total > memoryBudget) {
+        View* oldest = nullptr;
+        for (size_t i = 0; i < buffers.size(); i++) {
+            View& view = buffers[i];
+            if (int(i) == currentBuffer || !view.buffer || view.path.empty() || view.buffer.use_count() > 1) continue;
+            const Buffer& buffer = *view.buffer;
+            if (buffer.isModified() || buffer.isFollowing() || buffer.isStreaming()) continue;
+            if (!bufferOptions.persistUndo && buffer.getVersion() > 0) continue;
+            if (!oldest || view.lastShown < oldest->lastShown) oldest = &view;
+        }
+        if (!oldest) break;
+        total -= oldest->bytes;
+        oldest->buffer.reset();
+        oldest->measured = UINT64_MAX;
+    }
+}
+
+bool Editor::saveFile() {
+    if (saveJob) {
+        statusMessage = "Save already in progress";
+        return false;
+    }
+    if (buffers[currentBuffer].buffer->getFilePath().empty()) {
+        statusMessage = "No file name for buffer " + std::to_string(currentBuffer + 1);
+        return false;
+    }
+    saveJob = std::make_unique<SaveJob>(buffers[currentBuffer].buffer);
+    return true;
+}
+
+void Editor::pollSave() {
+    if (!saveJob) return;
+    if (saveJob->isFinished()) {
+        waitForSave();
     } else {
-        running = false;
+        statusMessage = "Saving " + saveJob->getPath() + ": " + formatBytes(saveJob->bytesWritten()) + " written";
+    }
+}
+
+void Editor::waitForSave() {
+    if (!saveJob) return;
+    statusMessage = saveJob->finish();
+    saveJob.reset();
+}
+
+void Editor::pollDisk() {
+    // A watcher event is reported a little after the write, and a mapped
+    // file truncated meanwhile would fault on the next render.
+    for (const auto& view : buffers) {
+        if (view.buffer) view.buffer->checkFile();
+    }
+    // Watcher events are held back while a save is running, so that its own
+    // writes are not taken for someone else's; they wait in the queue until
+    // it finishes.
+    if (!saveJob) for (const auto& path : watcher.poll()) {
+        for (size_t i = 0; i < buffers.size(); i++) {
+            Buffer* buffer = buffers[i].buffer.get();
+            if (!buffer || buffer->getFilePath() != path || buffer->isFollowing()) continue;
+            DiskChange change = buffer->syncWithDisk();
+            if (change == DiskChange::None) continue;
+            if (change == DiskChange::Conflict) {
+                statusMessage = path + " changed on disk and conflicts with unsaved edits";
+                continue;
+            }
+            statusMessage = (change == DiskChange::Merged ? "Merged changes to " : "Reloaded ") + path + " from disk";
+            if (int(i) == currentBuffer) {
+                clearCursors();
+                clampCursor();
+            }
+            pluginManager.notifyBufferChange(*buffer);
+        }
+    }
+    // Followed files are read every frame rather than on events, since a
+    // read that stopped at FollowReadLimit leaves bytes no event announces.
+    // Streams are read every frame too, but only followed files scroll.
+    for (size_t i = 0; i < buffers.size(); i++) {
+        if (!buffers[i].buffer) continue;
+        Buffer& buffer = *buffers[i].buffer;
+        bool current = int(i) == currentBuffer;
+        bool atEnd = current && buffer.isFollowing() && !buffer.hasLine(cursorRow + 1);
+        DiskChange change = buffer.readAppended();
+        if (change == DiskChange::None) continue;
+        if (change == DiskChange::Conflict) {
+            statusMessage = buffer.getFilePath() + " was truncated or replaced; stopped following it";
+            continue;
+        }
+        if (change == DiskChange::Reloaded) statusMessage = "Reloaded " + buffer.getFilePath() + " from disk";
+        if (current) {
+            if (change == DiskChange::Reloaded) clearCursors();
+            if (atEnd) {
+                cursorRow = buffer.getLineCount() - 1;
+                cursorCol = 0;
+            }
+            clampCursor();
+        }
+        pluginManager.notifyBufferChange(buffer);
+    }
+}
+
+namespace {
+
+std::string jsonString(const std::string& s) {
+    std::string out = "\"";
+    for (unsigned char c : s) {
+        if (c == '"' || c == '\\') {
+            out += '\\';
+            out += c;
+        } else if (c < 0x20) {
+            char escaped[8];
+            snprintf(escaped, sizeof escaped, "\\u%04x", c);
+            out += escaped;
+        } else {
+            out += c;
+        }
+    }
+    return out + '"';
+}
+
+std::string jsonFields(const MemoryUsage& usage) {
+    return "\"text\": " + std::to_string(usage.text) + ", \"index\": " + std::to_string(usage.index) +
+           ", \"undo\": " + std::to_string(usage.undo) + ", \"snapshots\": " + std::to_string(usage.snapshots) +
+           ", \"highlight\": " + std::to_string(usage.highlight) + ", \"total\": " + std::to_string(usage.total());
+}
+
+size_t residentBytes() {
+    size_t pages = 0, resident = 0;
+    std::ifstream statm("/proc/self/statm");
+    if (!(statm >> pages >> resident)) return 0;
+    return resident * size_t(sysconf(_SC_PAGESIZE));
+}
+
+}  // namespace
+
+// The dump is one JSON object: a record per open buffer, evicted ones with
+// zeros, and the totals next to the resident set size, which also holds
+// what no subsystem accounts for (code, allocator slack, mapped pages).
+void Editor::reportMemory(const std::string& path) {
+    MemoryUsage all;
+    size_t loaded = 0;
+    std::string json = "{\"buffers\": [";
+    for (size_t i = 0; i < buffers.size(); i++) {
+        const View& view = buffers[i];
+        MemoryUsage usage;
+        if (view.buffer) {
+            usage = view.buffer->memoryUsage();
+            all += usage;
+            loaded++;
+        }
+        json += std::string(i ? ", " : "") + "{\"path\": " + jsonString(view.path) +
+                ", \"loaded\": " + (view.buffer ? "true" : "false") + ", " + jsonFields(usage) + "}";
+    }
+    all.highlight = highlighter.memoryUsage() + lineScratch.capacity() + highlighted.capacity();
+    size_t rss = residentBytes();
+    json += "], \"total\": {" + jsonFields(all) + ", \"rss\": " + std::to_string(rss) + "}}\n";
+    if (path.empty()) {
+        statusMessage = "Memory: text " + formatBytes(all.text) + ", index " + formatBytes(all.index) + ", undo " +
+                        formatBytes(all.undo) + ", snapshots " + formatBytes(all.snapshots) + ", highlight " +
+                        formatBytes(all.highlight) + "; " + std::to_string(loaded) + "/" +
+                        std::to_string(buffers.size()) + " buffers loaded; RSS " + formatBytes(rss);
+        return;
+    }
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    out << json;
+    statusMessage = out.flush() ? "Memory report written to " + path : "Cannot write " + path;
+}
+
+void Editor::toggleFollow() {
+    Buffer& buffer = getCurrentBuffer();
+    if (buffer.isFollowing()) {
+        buffer.unfollow();
+        statusMessage = "Stopped following " + buffer.getFilePath();
+        return;
+    }
+    if (!buffer.follow()) {
+        statusMessage = "Cannot follow " + buffer.getFilePath();
+        return;
+    }
+    clearCursors();
+    cursorRow = buffer.getLineCount() - 1;
+    cursorCol = 0;
+    statusMessage = "Following " + buffer.getFilePath();
+}
+
+void Editor::clampCursor() {
+    Buffer& buffer = getCurrentBuffer();
+    cursorRow = std::max(cursorRow, 0);
+    if (!buffer.hasLine(cursorRow)) cursorRow = std::max(0, buffer.getLineCount() - 1);
+    cursorCol = std::max(0, std::min(cursorCol, int(buffer.getLineLength(cursorRow))));
+}
+
+void Editor::quit() {
+    if (saveJob) {
+        statusMessage = "Save in progress";
+        return;
+    }
+    for (size_t i = 0; i < buffers.size(); i++) {
+        if (!buffers[i].buffer || !buffers[i].buffer->isModified()) continue;
+        const std::string& path = buffers[i].path;
+        statusMessage = "Unsaved changes in " + (path.empty() ? "buffer " + std::to_string(i + 1) : path) +
+                        "! Use :q! to force quit";
+        return;
     }
+    running = false;
 }
 
 void Editor::render() {
@@ -292,13 +4562,16 @@ void Editor::render() {
     Terminal::clearScreen();
     
     auto [rows, cols] = Terminal::getWindowSize();
+    scroll();
     
     for (int i = 0; i < rows - 2; i++) {
         int fileRow = i + rowOffset;
-        if (fileRow < getCurrentBuffer().getLineCount()) {
-            std::string line = getCurrentBuffer().getLine(fileRow);
-            line = highlighter.highlight(line);
-            std::cout << line.substr(colOffset, cols) << "\r\n";
+        if (getCurrentBuffer().hasLine(fileRow)) {
+            // Only the visible columns are fetched and highlighted, so a
+            // 200 MB line costs no more to draw than a short one.
+            std::string_view line = getCurrentBuffer().getLineView(fileRow, colOffset, cols, lineScratch);
+            highlighter.highlight(line, highlighted);
+            std::cout << highlighted << "\r\n";
         } else {
             std::cout << "~\r\n";
         }
@@ -311,13 +4584,27 @@ void Editor::render() {
     Terminal::showCursor();
 }
 
+void Editor::scroll() {
+    auto [rows, cols] = Terminal::getWindowSize();
+    int height = std::max(rows - 2, 1);
+    if (cursorRow < rowOffset) rowOffset = cursorRow;
+    if (cursorRow >= rowOffset + height) rowOffset = cursorRow - height + 1;
+    if (cursorCol < colOffset) colOffset = cursorCol;
+    if (cursorCol >= colOffset + cols) colOffset = cursorCol - cols + 1;
+}
+
 void Editor::renderStatusBar() {
     auto [rows, cols] = Terminal::getWindowSize();
     Terminal::moveCursor(rows - 2, 0);
     std::cout << "\x1b[7m";
-    std::string status = getCurrentBuffer().getFilepath();
+    std::string status = getCurrentBuffer().getFilePath();
     if (getCurrentBuffer().isModified()) status += " [+]";
+    if (getCurrentBuffer().isFollowing()) status += " [follow]";
+    if (getCurrentBuffer().isStreaming()) status += " [reading: " + formatBytes(getCurrentBuffer().streamedBytes()) + "]";
+    if (size_t shared = getCurrentBuffer().getInternedBytes()) status += " | dedup saves " + formatBytes(shared);
     status += " | " + std::to_string(cursorRow + 1) + ":" + std::to_string(cursorCol + 1);
+    if (!cursors.empty()) status += " (" + std::to_string(cursors.size()) + " cursors)";
+    if (buffers.size() > 1) status += " | buffer " + std::to_string(currentBuffer + 1) + "/" + std::to_string(buffers.size());
     std::cout << status;
     for (int i = status.size(); i < cols; i++) std::cout << " ";
     std::cout << "\x1b[0m";
@@ -1,10 +1,18 @@
 #pragma once
 #include <string>
+#include <string_view>
 #include <vector>
 #include <memory>
 #include <functional>
 #include <map>
 #include <regex>
+#include <chrono>
+#include <deque>
+#include <atomic>
+#include <cstdint>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 
 using namespace std;
 
@@ -25,33 +33,620 @@ struct HighlightRule {
 };
 
 class SyntaxHighlighter {
+  struct Span {
+    size_t begin, end, rule;
+  };
+  // Spans of recently drawn lines by their text. std::regex allocates on
+  // every search, so only a line not seen lately is matched again.
+  struct CachedLine {
+    size_t hash = 0;
+    string text;
+    vector<Span> spans;
+  };
+  static constexpr size_t CacheLines = 256;
+
   vector<HighlightRule> rules;
+  vector<CachedLine> cache;
+  size_t nextSlot = 0;
+  cmatch match;
+
+  void findSpans(string_view line, vector<Span>& spans);
 public:
   void addRule(const string& pattern, const string& color);
   string highlight(const string& line);
+  // Writes the highlighted line to `out`, reusing its capacity. Where rules
+  // overlap, the rule added first wins.
+  void highlight(string_view line, string& out);
+  size_t memoryUsage() const;
+};
+
+enum class StorageKind { Lines, Arena, PieceTable, Rope, Mapped, Paged };
+
+struct BufferOptions {
+  StorageKind storage = StorageKind::Lines;
+  unsigned indexThreads = 0;  // 0 = one per hardware thread
+  size_t undoBudget = 64 << 20;
+  bool persistUndo = true;  // keep history in a sidecar file across sessions
+  bool intern = false;       // arena storage: store identical lines once
+};
+
+// Receives a document as a sequence of byte spans. A span only has to stay
+// valid until the next flush(), which writers call before reusing memory.
+class TextSink {
+public:
+  virtual ~TextSink() = default;
+  virtual void write(const char* data, size_t len) = 0;
+  virtual void flush() {}
+};
+
+// Replaces `length` bytes at `offset` with `text`.
+struct Edit {
+  size_t offset = 0, length = 0;
+  string text;
+};
+
+// Text is stored without the trailing newline that save() appends, so an
+// empty storage still has one (empty) line. Positions are (row, col) byte
+// coordinates; inserted text may contain '\n' and erase may span lines.
+class TextStorage {
+protected:
+  unsigned indexThreads = 1;
+public:
+  virtual ~TextStorage() = default;
+  void setIndexThreads(unsigned threads) { indexThreads = threads; }
+  // Independent copy that another thread may read while this one is edited.
+  virtual unique_ptr<TextStorage> clone() const = 0;
+  virtual void load(const string& path);
+  virtual void assign(string text) = 0;
+  virtual bool hasLine(size_t row) const { return row < lineCount(); }
+  virtual size_t lineCount() const = 0;
+  virtual size_t lineLength(size_t row) const = 0;
+  virtual string line(size_t row) const = 0;
+  // Up to `len` bytes of `row` from `col`. The view points into the storage
+  // where those bytes are contiguous and into `scratch` otherwise; it stays
+  // valid until the next edit or the next call with the same scratch.
+  virtual string_view lineView(size_t row, size_t col, size_t len, string& scratch) const;
+  string line(size_t row, size_t col, size_t len) const;
+  // Byte offset of the start of `row`, and the row containing `offset`.
+  virtual size_t offsetOf(size_t row) const = 0;
+  virtual size_t rowAt(size_t offset) const;
+  // Bytes [offset, offset + len) of the file this storage would save,
+  // i.e. including the final newline.
+  string read(size_t offset, size_t len) const;
+  string read(size_t row, size_t col, size_t len) const;
+  // Length of the document, which excludes the final newline.
+  virtual size_t size() const { return offsetOf(lineCount() - 1) + lineLength(lineCount() - 1); }
+  // The longest contiguous run of the document starting at `offset`, or
+  // ending at it for chunkBefore, as a view into the storage or into
+  // `scratch`. Empty past the end (before the start).
+  virtual string_view chunkAt(size_t offset, string& scratch) const;
+  virtual string_view chunkBefore(size_t offset, string& scratch) const;
+  // True if unedited text is still read from the file it was loaded from.
+  virtual bool readsFromFile() const { return false; }
+  // Keeps reads within that file if another program has truncated it,
+  // which costs an fstat. Text the file no longer holds reads as empty.
+  virtual void clampToFile() const {}
+  // Stops reading that file after another program changed it in place,
+  // keeping in memory the text it still holds. Storage that cannot hold
+  // the file in memory clamps to it instead.
+  virtual void detach() {}
+  // False if const calls update lazy state, so other threads need a clone
+  // rather than a shared reference.
+  virtual bool concurrentReads() const { return true; }
+  // Bytes of line text that identical lines share instead of storing again.
+  virtual size_t internedBytes() const { return 0; }
+  // Heap bytes held, approximately, for the text and for the indexes that
+  // locate lines in it. Pages of a mapped file are left out; the kernel
+  // can drop those on its own.
+  virtual size_t textMemory() const = 0;
+  virtual size_t indexMemory() const = 0;
+  size_t memoryUsage() const { return textMemory() + indexMemory(); }
+  virtual void insert(size_t row, size_t col, const string& text) = 0;
+  virtual void erase(size_t row, size_t col, size_t len) = 0;
+  // Applies edits sorted by offset that do not overlap, last first so the
+  // positions of the others hold, and returns the text each one removed.
+  // Every layout but the rope, whose edits cost O(log n) each, does the
+  // batch in one pass.
+  virtual vector<string> apply(const vector<Edit>& edits);
+  // Adds `text` at the end of the document at a cost that depends on the
+  // text and not on the document, which a tailed file needs.
+  virtual void append(const string& text);
+  virtual void writeTo(TextSink& sink) const = 0;
+};
+
+constexpr size_t ParallelIndexThreshold = 64 << 20;
+
+// Most workers an index or scan uses: a few per hardware thread. Larger
+// requests are cut down to this.
+unsigned maxIndexThreads();
+
+// Appends base + i for every '\n' at data[i]. Uses AVX2 or SSE2 when the
+// CPU has them, picked once at first use. Inputs of at least
+// ParallelIndexThreshold bytes are split across `threads` workers
+// (0 = one per hardware thread).
+void indexNewlines(const char* data, size_t len, size_t base, vector<size_t>& out, unsigned threads = 1);
+
+unique_ptr<TextStorage> makeStorage(const BufferOptions& options);
+bool parseStorageKind(const string& name, StorageKind& kind);
+
+struct SaveStats {
+  size_t bytes = 0;
+  double seconds = 0;
+  bool inPlace = false;
+};
+
+// Identity of a file on disk, used to tell whether it changed behind our back.
+struct FileStamp {
+  bool valid = false;
+  uint64_t device = 0, inode = 0, size = 0;
+  int64_t mtimeNs = 0;
+
+  bool operator==(const FileStamp& o) const {
+    return valid && o.valid && device == o.device && inode == o.inode && size == o.size && mtimeNs == o.mtimeNs;
+  }
+};
+
+FileStamp stampFile(const string& path);
+
+// Undo history of `path` lives next to it as .<name>.ttundo.
+string undoFilePath(const string& path);
+
+// A content-defined piece of a file: boundaries depend only on the bytes
+// around them, so an edit changes the chunks it touches and leaves the
+// others as they were.
+struct TextChunk {
+  size_t offset = 0, length = 0;
+  uint64_t hash = 0;
+};
+
+// A file as last loaded or saved, in chunks of the text it holds (the file
+// without its final newline). `known` is false when the chunks could not be
+// taken, e.g. because the file changed while it was being read.
+struct DiskImage {
+  FileStamp stamp;
+  vector<TextChunk> chunks;
+  bool known = false;
+};
+
+DiskImage scanFile(const string& path, unsigned threads = 0);
+
+// Reports files changed on disk. Watches the directories holding them, so a
+// file replaced by rename, as atomic saves do, is still noticed.
+class FileWatcher {
+  using Clock = chrono::steady_clock;
+  struct Pending {
+    Clock::time_point first, last;
+  };
+  static constexpr chrono::milliseconds QuietPeriod{100}, MaxDelay{1000};
+
+  int fd = -1;
+  map<int, string> directories;
+  map<string, vector<string>> files;  // normalized path -> paths as given
+  map<string, Pending> pending;       // changed, not yet reported
+
+public:
+  FileWatcher();
+  ~FileWatcher();
+  FileWatcher(const FileWatcher&) = delete;
+  FileWatcher& operator=(const FileWatcher&) = delete;
+
+  void watch(const string& path);
+  // Watched paths written, created or renamed into place, as they were
+  // passed to watch(). A path is reported once it has had no events for
+  // QuietPeriod, or MaxDelay after its first unreported one if it keeps
+  // changing, so a file being written is not read once per write. Never
+  // blocks.
+  vector<string> poll();
+};
+
+// Reads what gets appended to a file through a descriptor kept open, so
+// each read costs only the new bytes however large the file has grown.
+class FileTail {
+  int fd = -1;
+  string path;
+  size_t offset = 0;
+
+public:
+  FileTail() = default;
+  ~FileTail() { close(); }
+  FileTail(const FileTail&) = delete;
+  FileTail& operator=(const FileTail&) = delete;
+
+  // Starts reading `path` at byte `from`.
+  bool open(const string& path, size_t from);
+  void close();
+  bool isOpen() const { return fd >= 0; }
+  // Appends up to `limit` bytes written since the last call to `out`.
+  // False if the file shrank below what was read or `path` now names
+  // another file, as after log rotation.
+  bool read(string& out, size_t limit);
+  FileStamp stamp() const;
+};
+
+// Most bytes a followed or streamed buffer takes in per read, so a burst
+// of output is spread over several frames instead of stalling one.
+constexpr size_t FollowReadLimit = 16 << 20;
+
+// Reads a pipe or other stream to its end on a worker thread, so that a
+// slow or endless producer never blocks the editing thread, which takes
+// what has arrived so far. The worker stops reading while more than
+// Backlog bytes wait, which holds the producer back in turn.
+class StreamReader {
+  static constexpr size_t Backlog = 2 * FollowReadLimit;
+
+  int fd;
+  mutex lock;
+  condition_variable space;
+  string pending;
+  atomic<size_t> total{0};
+  atomic<bool> done{false};
+  bool stopping = false;
+  thread worker;
+
+public:
+  // Takes ownership of `fd`.
+  explicit StreamReader(int fd);
+  ~StreamReader();
+  StreamReader(const StreamReader&) = delete;
+  StreamReader& operator=(const StreamReader&) = delete;
+
+  // Moves up to `limit` bytes that have arrived to the end of `out`.
+  void take(string& out, size_t limit);
+  // True once the stream has ended and everything in it has been taken.
+  bool finished();
+  size_t bytesRead() const { return total; }
+};
+
+// Byte ranges of the document that no longer match the file on disk, in
+// current document offsets. Each range also records how much it grew or
+// shrank, which tells whether the untouched bytes after it have moved.
+class DirtyRanges {
+public:
+  struct Range {
+    size_t begin, end;
+    int64_t delta;
+  };
+private:
+  vector<Range> ranges;
+public:
+  void inserted(size_t offset, size_t len);
+  void erased(size_t offset, size_t len);
+  // Same as erased() then inserted() for each edit, last first, but in a
+  // single pass over the ranges.
+  void applied(const vector<Edit>& edits);
+  // Moves sorted edits given in offsets of the file as last saved to
+  // offsets of the document. False if one of them overlaps or touches an
+  // edited range, which leaves the edits unusable.
+  bool fromDisk(vector<Edit>& edits) const;
+  // Moves the ranges past edits that came from the file, given in offsets
+  // of the document and touching no range, without marking them edited.
+  void moved(const vector<Edit>& edits);
+  void clear() { ranges.clear(); }
+  // [begin, end) of the document per edited range, with the size change.
+  const vector<Range>& edited() const { return ranges; }
+  int64_t sizeDelta() const;
+  // Regions of the new file (`fileSize` bytes) that have to be written to
+  // turn the old file into it. Sets `shifted` if untouched bytes moved.
+  vector<pair<size_t, size_t>> regions(size_t fileSize, bool& shifted) const;
+};
+
+// Everything a save needs, captured on the editing thread.
+struct SaveRequest {
+  shared_ptr<const TextStorage> snapshot;
+  string path;
+  uint64_t version = 0;
+  bool inPlace = false;
+  FileStamp expected;
+  size_t fileSize = 0;
+  vector<pair<size_t, size_t>> patches;
+  // The storage reads the file, and its line index was built from the
+  // bytes there, so a patch may not add, remove or move a '\n'.
+  bool keepNewlines = false;
+  size_t journal = 0;  // undo journal bytes that describe the saved text
+  DiskImage image;     // the file before the save
+  DirtyRanges changes;  // where the saved text differs from it
+};
+
+// The saved file's image, from the one before the save with the changed
+// ranges chunked again, so the file is not read back. Unknown if the
+// image before was.
+DiskImage imageAfterSave(const SaveRequest& request);
+
+// Patches the file with pwrite when the request allows it, the file is
+// unchanged since planning and, if the request says so, the patch keeps
+// its newlines; otherwise rewrites it atomically.
+SaveStats performSave(const SaveRequest& request, atomic<size_t>* progress);
+
+constexpr size_t InPlaceMinFileSize = 1 << 20;
+
+// Line-per-string storage moves to a rope once a line is at least this
+// long, whether loaded, pasted or appended, so an edit no longer moves the
+// whole line. The overlays keep their layout: a rope would need the whole
+// file in memory, and checking at open would index the whole file. They
+// read only the visible columns of an original line, however long, and an
+// edited line is copied into the overlay as before.
+constexpr size_t LongLineThreshold = 1 << 20;
+
+string formatBytes(double bytes);
+string formatSeconds(double seconds);
+
+// Edit history as compact operations: at `offset`, `removed` was replaced
+// by `inserted`. Undo and redo cost the size of the edit, never the size of
+// the buffer, and the oldest entries are dropped once the history exceeds
+// its memory budget.
+//
+// Every operation is also appended to a journal in the undo file's record
+// format, so saving extends the file with just the operations since the
+// last save. The newest entry stays out of the journal while it can still
+// coalesce. A log that is not persisted keeps no journal, and one that
+// outgrows the budget is dropped; the undo file is then rewritten whole.
+class UndoLog {
+public:
+  struct Entry {
+    size_t offset = 0;
+    string removed, inserted;
+    chrono::steady_clock::time_point time;
+    bool joined = false;  // undone and redone together with the entry below
+  };
+  static constexpr chrono::milliseconds CoalesceWindow{1000};
+
+  explicit UndoLog(size_t budget, bool journaled = true);
+  void record(size_t offset, const string& removed, const string& inserted, bool joined = false);
+  // Starts a new undo step even if the next edit continues the last one.
+  void breakGroup() { seal(); }
+  bool popUndo(Entry& entry);
+  bool popRedo(Entry& entry);
+  bool redoJoined() const { return !redoStack.empty() && redoStack.back().joined; }
+  bool empty() const { return undoStack.empty() && redoStack.empty(); }
+  size_t memoryUsage() const { return bytes; }
+  size_t journalMemory() const;
+
+  size_t journalSize() const { return journal.size(); }
+  // False once records were dropped since restartJournal().
+  bool journalComplete() const { return !dropped; }
+  string takeJournal(size_t len);
+  void restartJournal();
+  void setJournaled(bool on);
+  // The whole history as undo file records, for rewriting the file.
+  string serialize() const;
+  // Rebuilds the history from undo file records.
+  void replay(const char* data, size_t len);
+
+private:
+  deque<Entry> undoStack;
+  vector<Entry> redoStack;
+  size_t budget;
+  size_t bytes = 0;
+  bool open = false;
+  bool journaled;
+  bool dropped = false;
+  string journal;
+
+  static size_t cost(const Entry& entry);
+  void seal();
+  void clearRedo();
+  void trim();
+  void note(char record);
+  void limitJournal();
+};
+
+// Streams a document as contiguous spans taken straight from its storage,
+// forwards or backwards from any offset. A span is valid until the next
+// step. The cursor keeps the storage alive, so a buffer edited meanwhile
+// copies it first and the cursor goes on reading the old text.
+class ChunkCursor {
+  shared_ptr<const TextStorage> storage;
+  size_t offset;
+  string scratch;
+
+public:
+  ChunkCursor(shared_ptr<const TextStorage> storage, size_t offset) : storage(move(storage)), offset(offset) {}
+  // The span starting at the cursor, moving past it; false at the end.
+  bool next(string_view& chunk);
+  // The span ending at the cursor, moving before it; false at the start.
+  bool prev(string_view& chunk);
+  size_t position() const { return offset; }
+};
+
+// The text of a buffer at one version, safe to read on any thread for as
+// long as it is held.
+class BufferSnapshot {
+  shared_ptr<const TextStorage> storage;
+  uint64_t version = 0;
+
+public:
+  BufferSnapshot(shared_ptr<const TextStorage> storage, uint64_t version) : storage(move(storage)), version(version) {}
+  string getLine(int row) const { return hasLine(row) ? storage->line(row) : ""; }
+  string_view getLineView(int row, string& scratch) const {
+    return hasLine(row) ? storage->lineView(row, 0, string::npos, scratch) : string_view();
+  }
+  bool hasLine(int row) const { return row >= 0 && storage->hasLine(row); }
+  size_t getLineLength(int row) const { return hasLine(row) ? storage->lineLength(row) : 0; }
+  int getLineCount() const { return storage->lineCount(); }
+  uint64_t getVersion() const { return version; }
+  const shared_ptr<const TextStorage>& text() const { return storage; }
+  ChunkCursor chunks(size_t offset = 0) const { return ChunkCursor(storage, offset); }
+};
+
+enum class DiskChange { None, Merged, Reloaded, Conflict };
+
+// Approximate heap bytes, by what holds them.
+struct MemoryUsage {
+  size_t text = 0;       // the document in its storage
+  size_t index = 0;      // line indexes over it
+  size_t undo = 0;       // history, and the journal not yet saved
+  size_t snapshots = 0;  // older versions that snapshots keep alive
+  size_t highlight = 0;  // highlighter and render buffers, editor-wide
+
+  size_t total() const { return text + index + undo + snapshots + highlight; }
+  MemoryUsage& operator+=(const MemoryUsage& o) {
+    text += o.text;
+    index += o.index;
+    undo += o.undo;
+    snapshots += o.snapshots;
+    highlight += o.highlight;
+    return *this;
+  }
 };
 
 class Buffer {
-  vector<string> lines;
+  // Shared with live snapshots; edits go through mutableStorage(), which
+  // copies it first while any are held.
+  shared_ptr<TextStorage> storage;
+  BufferOptions options;
+  // What `storage` is, which differs from options.storage once a long line
+  // has moved line or arena storage to a rope.
+  StorageKind layout;
   string filepath;
   bool modified = false;
+  uint64_t version = 0;
+  DirtyRanges dirty;
+  FileStamp disk;
+  DiskImage image;
+  UndoLog history;
+  // Storage handed out by snapshot(), with its size if measuring it later
+  // would race with the thread reading it, or SIZE_MAX.
+  mutable vector<pair<weak_ptr<const TextStorage>, size_t>> handedOut;
+  FileTail tail;
+  unique_ptr<StreamReader> stream;
+  bool newlinePending = false;  // last byte appended, held back as the final newline
+  // Bytes of the undo file that end in a checkpoint matching `disk`; zero
+  // when the file has to be rewritten from the in-memory history.
+  size_t undoFileSize = 0;
+
+  void touch() {
+    modified = true;
+    version++;
+  }
+  TextStorage& mutableStorage();
+  void recordEdit(size_t offset, const string& removed, const string& inserted);
+  // Applies an edit without recording it in the history.
+  void replaceAt(size_t offset, size_t len, const string& text);
+  void loadHistory();
+  void saveHistory(const SaveRequest& request);
+  // For a conflict with a file that storage still reads from.
+  void detachFromFile();
+  // applyEdits(), optionally leaving the history as it is.
+  bool applyBatch(vector<Edit> edits, bool record);
+  // Adds bytes that followed the text at the end, outside the history.
+  void appendText(string text);
+  // Moves line or arena storage to a rope if a line overlapping the `len`
+  // bytes at `offset` has reached LongLineThreshold.
+  void limitLineLength(size_t offset, size_t len);
 public:
-  Buffer() { lines.push_back(""); }
-  explicit Buffer(const string& path);
+  explicit Buffer(const BufferOptions& options = {});
+  Buffer(const string& path, const BufferOptions& options = {});
 
   void insertChar(int row, int col, char c);
   void deleteChar(int row, int col);
   void insertLine(int row);
   void deleteLine(int row);
+  void splitLine(int row, int col);
+  // Revert or reapply one history step; (row, col) receives the position
+  // the cursor should move to.
+  bool undo(int& row, int& col);
+  bool redo(int& row, int& col);
+  // Applies non-overlapping edits, given in offsets of the current text,
+  // as one step: one pass over the storage and one undo entry. Returns
+  // false without changing anything if an edit overlaps another or runs
+  // past the end.
+  bool applyEdits(vector<Edit> edits);
 
   string getLine(int row) const;
-  int getLineCount() const { return lines.size(); }
+  string getLine(int row, int col, int len) const;
+  // Non-owning access for hot paths such as rendering; see
+  // TextStorage::lineView for how long the view stays valid.
+  string_view getLineView(int row, string& scratch) const {
+    return hasLine(row) ? storage->lineView(row, 0, string::npos, scratch) : string_view();
+  }
+  string_view getLineView(int row, int col, int len, string& scratch) const;
+  bool hasLine(int row) const { return row >= 0 && storage->hasLine(row); }
+  size_t getLineLength(int row) const { return hasLine(row) ? storage->lineLength(row) : 0; }
+  int getLineCount() const { return storage->lineCount(); }
+  size_t getInternedBytes() const { return storage->internedBytes(); }
+  // Snapshots count once each, and in full although a rope shares most of
+  // its nodes with the versions after it.
+  MemoryUsage memoryUsage() const;
+  size_t getSize() const { return storage->size(); }
+  // For reading on this thread; take a snapshot to read on another.
+  ChunkCursor chunks(size_t offset = 0) const { return ChunkCursor(storage, offset); }
+  // Conversions between (row, col) and byte offsets in the saved text;
+  // O(log n) for line storage and ropes, a binary search over running
+  // totals for the piece table, and a walk over their runs for the
+  // overlays.
+  size_t offsetOf(int row, int col) const { return storage->offsetOf(row) + col; }
+  void positionOf(size_t offset, int& row, int& col) const;
   bool isModified() const { return modified; }
-  void save();
+  uint64_t getVersion() const { return version; }
+  // O(1) for storage that tolerates concurrent reads; the first edit while
+  // the snapshot is alive pays for the copy, which is O(log n) for ropes,
+  // O(pieces) for the piece table, one pointer per block of lines for line
+  // storage and a full copy for the arena. The overlays are copied here,
+  // runs plus one pointer per 64K line starts.
+  BufferSnapshot snapshot() const;
+  SaveStats save();
+  // Plans a save of the current contents and starts tracking edits afresh.
+  // With `detach` the request holds its own copy of the text, so it can be
+  // written on another thread while editing continues.
+  SaveRequest prepareSave(bool detach);
+  // `scanned` is the saved file if the caller already scanned it.
+  void finishSave(const SaveRequest& request, bool saved, DiskImage scanned = {});
   void load();
+  // Brings in changes another program made to the file. Only the chunks
+  // that differ from the file as last loaded or saved are applied, as one
+  // edit that can be undone if the buffer has any history, and unsaved
+  // edits are kept unless they touch those regions; then nothing changes
+  // and Conflict is returned. A buffer that still reads from a file changed
+  // that way is detached from it first.
+  DiskChange syncWithDisk();
+  // Keeps storage that reads the file within it, should another program
+  // truncate it before the change is reported. Cheap enough for every frame.
+  void checkFile() const { storage->clampToFile(); }
+  // Keeps the file open and appends whatever is written to it from now on,
+  // after bringing in earlier changes. False if it cannot be followed, e.g.
+  // because those changes conflict with unsaved edits.
+  bool follow();
+  void unfollow() { tail.close(); }
+  bool isFollowing() const { return tail.isOpen(); }
+  // Fills the buffer from `fd`, e.g. a pipe, as data arrives on it rather
+  // than all at once; see readAppended(). Takes ownership of `fd`.
+  void streamFrom(int fd) { stream = make_unique<StreamReader>(fd); }
+  bool isStreaming() const { return stream != nullptr; }
+  size_t streamedBytes() const { return stream ? stream->bytesRead() : 0; }
+  // Appends the bytes written to a followed file, or that arrived on the
+  // stream, since the last call, at a cost proportional to them and
+  // outside the undo history; Merged if any arrived. A followed file that
+  // is truncated or replaced is reloaded, or stops being followed
+  // (Conflict) if the buffer has unsaved edits, which also detaches it
+  // from the file.
+  DiskChange readAppended();
 
+  // The backend in use, which is a rope once a long line has moved to one.
+  StorageKind getStorageKind() const { return layout; }
   const string& getFilePath() const { return filepath; }
-  void setFilepath(const strings& path) { filepath = path; }
+  void setFilepath(const string& path);
+};
+
+// Streams a snapshot of a buffer to disk on a worker thread, so editing
+// continues while a large file is written.
+class SaveJob {
+  shared_ptr<Buffer> buffer;
+  SaveRequest request;
+  atomic<size_t> written{0};
+  atomic<bool> finished{false};
+  SaveStats stats;
+  DiskImage scanned;
+  string error;
+  thread worker;
+public:
+  explicit SaveJob(shared_ptr<Buffer> buffer);
+  ~SaveJob();
+
+  bool isFinished() const { return finished; }
+  size_t bytesWritten() const { return written; }
+  const string& getPath() const { return request.path; }
+  // Waits for the worker, marks the buffer saved, and returns a status line.
+  string finish();
 };
 
 class Plugin {
@@ -60,6 +655,9 @@ public:
   virtual void onLoad() {}
   virtual void onKeyPress(int key) {}
   virtual void onBufferChange() {}
+  // Called after onBufferChange with the buffer that changed. Read it with
+  // getLineView to avoid copying its lines.
+  virtual void onBufferEdited(const Buffer&) {}
   virtual string getName() const = 0;
 };
 
@@ -67,9 +665,9 @@ class PluginManager{
   map<string, shared_ptr<Plugin>> plugins;
 public:
   void loadPlugin(shared_ptr<Plugin> plugin);
-  void loadPlugin(const string& name);
+  void unloadPlugin(const string& name);
   void notifyKeyPress(int key);
-  void notifyBufferChange();
+  void notifyBufferChange(const Buffer& buffer);
 };
 
 class FileExplorer {
@@ -83,9 +681,26 @@ public:
 };
 
 class Editor {
-  vector<shared_ptr<Buffer>> buffers;
+  // An open buffer and where it was last viewed. A file's buffer is loaded
+  // the first time it is shown, and dropped again while it is inactive and
+  // unmodified if the buffers outgrow the memory budget; the view stays, so
+  // showing it again reloads the file at the same position.
+  struct View {
+    shared_ptr<Buffer> buffer;  // null until loaded and once evicted
+    string path;
+    int cursorRow = 0, cursorCol = 0, rowOffset = 0, colOffset = 0;
+    uint64_t lastShown = 0;
+    size_t bytes = 0;              // memory use as of version `measured`
+    uint64_t measured = UINT64_MAX;
+  };
+  vector<View> buffers;
   int currentBuffer = 0;
+  uint64_t showCount = 0;
+  size_t memoryBudget = size_t(1) << 30;
   int cursorRow = 0, cursorCol = 0;
+  // With more than one cursor, every one of them as a byte offset, sorted.
+  // The primary cursor above is among them.
+  vector<size_t> cursors;
   int rowOffset = 0, colOffset = 0;
   string statusMessage;
   string commandBuffer;
@@ -96,6 +711,10 @@ class Editor {
   PluginManager pluginManager;
   FileExplorer fileExplorer;
   bool showExplorer = false;
+  string lineScratch, highlighted;  // reused by render() across lines and frames
+  unique_ptr<SaveJob> saveJob;
+  BufferOptions bufferOptions;
+  FileWatcher watcher;
 
 public:
   Editor();
@@ -104,19 +723,48 @@ public:
   void run();
   void processKeyPress();
   void moveCursor();
-  void insertChar();
+  void insertChar(char c);
   void deleteChar();
   void newLine();
+  void undo();
+  void redo();
+  void applyEdits(vector<Edit> edits);
+  void editAtCursors(const string& text, bool backspace);
+  void addCursors(const string& text);
+  void clearCursors();
+  void replaceAll(const string& from, const string& to);
   void executeCommand(const string& cmd);
   void render();
+  void scroll();
   void renderStatusBar();
   void renderCommandLine();
 
-  void openFile(const string& filepath);
-  void saveFile();
+  // Shows the file unless `show` is false, in which case it is only
+  // loaded once shown.
+  void openFile(const string& filepath, bool show = true);
+  void showBuffer(int index);
+  // Evicts least recently shown buffers until loaded ones fit the budget.
+  void evictBuffers();
+  void setMemoryBudget(size_t bytes) { memoryBudget = bytes; }
+  // Memory use per buffer and in total as JSON, written to `path`, or
+  // summed up in the status line when `path` is empty.
+  void reportMemory(const string& path);
+  // Opens a buffer that fills from `fd` in the background.
+  void openStream(int fd);
+  // Starts saving the current buffer; false, with a status message, if a
+  // save is already running or the buffer has no file, as one read from
+  // standard input does not.
+  bool saveFile();
+  void pollSave();
+  void waitForSave();
+  // Brings in changes other programs made to open files.
+  void pollDisk();
+  void toggleFollow();
+  void clampCursor();
   void quit();
+  void setBufferOptions(const BufferOptions& options) { bufferOptions = options; }
 
-  Buffer& getCurrentBuffer() { return *buffers[currentBuffer]; }
+  Buffer& getCurrentBuffer() { return *buffers[currentBuffer].buffer; }
 };
 
 
@@ -1,7 +1,87 @@
+#include "editor.hpp"
+#include <iostream>
+#include <cerrno>
+#include <climits>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+
 int main(int argc, char* argv[]) {
+  BufferOptions options;
+  size_t memoryBudget = 0;
+  vector<string> paths;
+  for (int i = 1; i < argc; i++) {
+    string arg = argv[i];
+    if (arg.rfind("--storage=", 0) == 0) {
+      if (!parseStorageKind(arg.substr(10), options.storage)) {
+        cerr << "unknown storage: " << arg.substr(10) << "\n";
+        return 1;
+      }
+      continue;
+    }
+    if (arg.rfind("--threads=", 0) == 0) {
+      // stoul would take "-1" and wrap it around, so only digits are read.
+      string value = arg.substr(10);
+      unsigned long threads = ULONG_MAX;
+      if (!value.empty() && value.find_first_not_of("0123456789") == string::npos && value.size() < 10) {
+        threads = stoul(value);
+      }
+      if (threads > maxIndexThreads()) {
+        cerr << "invalid thread count: " << value << " (0 to " << maxIndexThreads() << ")\n";
+        return 1;
+      }
+      options.indexThreads = threads;
+      continue;
+    }
+    if (arg == "--intern") {
+      options.storage = StorageKind::Arena;
+      options.intern = true;
+      continue;
+    }
+    if (arg.rfind("--memory-budget=", 0) == 0) {
+      // In MiB; digits only for the same reason as --threads, and no more
+      // than the shift to bytes can hold.
+      string value = arg.substr(16);
+      unsigned long long mib = 0;
+      if (!value.empty() && value.find_first_not_of("0123456789") == string::npos && value.size() < 20) {
+        mib = stoull(value);
+      }
+      if (mib == 0 || mib > (SIZE_MAX >> 20)) {
+        cerr << "invalid memory budget: " << value << " (1 to " << (SIZE_MAX >> 20) << " MiB)\n";
+        return 1;
+      }
+      memoryBudget = size_t(mib) << 20;
+      continue;
+    }
+    if (arg == "--no-undo-file") {
+      options.persistUndo = false;
+      continue;
+    }
+    paths.push_back(arg);
+  }
+  // With "-" the text comes from stdin, so keys are read from the terminal
+  // instead; the editor takes its raw mode on whatever stdin is then.
+  int input = -1;
+  bool fromStdin = false;
+  for (const auto& path : paths) fromStdin = fromStdin || path == "-";
+  if (fromStdin) {
+    int tty = open("/dev/tty", O_RDWR | O_CLOEXEC);
+    if (tty < 0) {
+      cerr << "cannot open /dev/tty for keyboard input: " << strerror(errno) << "\n";
+      return 1;
+    }
+    input = dup(STDIN_FILENO);
+    dup2(tty, STDIN_FILENO);
+    close(tty);
+  }
   Editor editor;
-  if (argc > 1) {
-    editor.openFile(argv[1]);
+  editor.setBufferOptions(options);
+  if (memoryBudget > 0) editor.setMemoryBudget(memoryBudget);
+  // Only the first file is loaded now; the others are loaded when shown.
+  for (size_t i = 0; i < paths.size(); i++) {
+    if (paths[i] != "-") editor.openFile(paths[i], i == 0);
+    else if (input >= 0) editor.openStream(input);
+    if (paths[i] == "-") input = -1;
   }
   editor.run();
   return 0;
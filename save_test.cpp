@@ -0,0 +1,84 @@
+// Regression test for patching a file in place under storage that keeps
+// reading it: mapped and paged buffers.
+//
+//   g++ -O2 -std=c++17 -pthread save_test.cpp editor.cpp -o save_test
+//   ./save_test
+//
+// Exits with status 1 and names the case if a line read back after the save,
+// or the saved file, differs from the document.
+#include "editor.hpp"
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+static void writeFile(const string& path, const string& text) {
+  ofstream(path, ios::binary | ios::trunc) << text;
+}
+
+static string readFile(const string& path) {
+  ifstream in(path, ios::binary);
+  stringstream out;
+  out << in.rdbuf();
+  return out.str();
+}
+
+static string numbered(int lines) {
+  string text;
+  for (int i = 0; i < lines; i++) text += "line " + to_string(i) + " of the file under test\n";
+  return text;
+}
+
+// Row `row` of `text`, which ends in a newline.
+static string lineOf(const string& text, int row) {
+  size_t start = 0;
+  for (int r = 0; r < row; r++) start = text.find('\n', start) + 1;
+  return text.substr(start, text.find('\n', start) - start);
+}
+
+// Loads `text`, replaces the byte at `offset` with `with` and saves, then
+// reads rows from the end back to the start so the paged window is filled
+// again from the saved file, and checks the first rows and the file.
+static bool replaceThenSave(const string& name, StorageKind storage, const string& text, size_t offset, char with,
+                            bool inPlace) {
+  string path = "/tmp/terminaltext_save_test.txt";
+  writeFile(path, text);
+  BufferOptions options;
+  options.storage = storage;
+  options.persistUndo = false;
+  Buffer buffer(path, options);
+  buffer.applyEdits({Edit{offset, 1, string(1, with)}});
+  string expected = text;
+  expected[offset] = with;
+  SaveStats stats = buffer.save();
+  if (stats.inPlace != inPlace) {
+    cerr << name << ": saved " << (stats.inPlace ? "in place" : "by rewriting") << "\n";
+    return false;
+  }
+  for (int r = buffer.getLineCount() - 1; r > 0; r -= 997) buffer.getLine(r);
+  for (int r = 0; r < 3; r++) {
+    if (buffer.getLine(r) != lineOf(expected, r)) {
+      cerr << name << ": row " << r << " read after the save differs from the document\n";
+      return false;
+    }
+  }
+  if (readFile(path) != expected) {
+    cerr << name << ": saved file differs from the document\n";
+    return false;
+  }
+  return true;
+}
+
+int main() {
+  // More than the 64 pages of 1 MiB that paged storage keeps, so pages are
+  // read again from the patched file.
+  string text = numbered(2500000);
+  size_t newline = text.find('\n');
+  bool ok = true;
+  for (StorageKind storage : {StorageKind::Mapped, StorageKind::Paged}) {
+    string kind = storage == StorageKind::Mapped ? "mapped, " : "paged, ";
+    ok &= replaceThenSave(kind + "newline replaced", storage, text, newline, '#', false);
+    ok &= replaceThenSave(kind + "letter replaced", storage, text, newline + 1, 'L', true);
+  }
+  if (ok) cout << "ok\n";
+  return ok ? 0 : 1;
+}
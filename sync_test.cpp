@@ -0,0 +1,111 @@
+// Regression test for saving after an external change was merged into a
+// buffer with unsaved edits, and for files truncated under one.
+//
+//   g++ -O2 -std=c++17 -pthread sync_test.cpp editor.cpp -o sync_test
+//   ./sync_test
+//
+// Exits with status 1 and names the case if a saved file differs from the
+// document.
+#include "editor.hpp"
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <thread>
+
+static void writeFile(const string& path, const string& text) {
+  ofstream(path, ios::binary | ios::trunc) << text;
+}
+
+static string readFile(const string& path) {
+  ifstream in(path, ios::binary);
+  stringstream out;
+  out << in.rdbuf();
+  return out.str();
+}
+
+// Loads `before`, replaces or inserts one byte at (row, col), lets another
+// program write `after`, merges, saves and checks the file against the
+// document.
+static bool mergeThenSave(const string& name, const string& before, const string& after, int row, int col,
+                          bool replace) {
+  string path = "/tmp/terminaltext_sync_test.txt";
+  writeFile(path, before);
+  BufferOptions options;
+  options.persistUndo = false;
+  Buffer buffer(path, options);
+  if (replace) buffer.applyEdits({Edit{buffer.offsetOf(row, col), 1, "#"}});
+  else buffer.insertChar(row, col, '#');
+  // Stamps can have coarse timestamps; a different size is always seen.
+  this_thread::sleep_for(chrono::milliseconds(10));
+  writeFile(path, after);
+  if (buffer.syncWithDisk() != DiskChange::Merged) {
+    cerr << name << ": external change not merged\n";
+    return false;
+  }
+  string expected;
+  for (int r = 0; r < buffer.getLineCount(); r++) expected += buffer.getLine(r) + "\n";
+  buffer.save();
+  if (readFile(path) != expected) {
+    cerr << name << ": saved file differs from the document\n";
+    return false;
+  }
+  return true;
+}
+
+// Loads `text` into storage that reads the file, edits it, truncates the
+// file and lets the buffer notice, by an event or by following the file.
+// The buffer must report a conflict and still read every line.
+static bool truncateWhileModified(const string& name, StorageKind storage, const string& text, bool follow) {
+  string path = "/tmp/terminaltext_sync_test.txt";
+  writeFile(path, text);
+  BufferOptions options;
+  options.storage = storage;
+  options.persistUndo = false;
+  Buffer buffer(path, options);
+  if (follow) buffer.follow();
+  buffer.insertChar(0, 0, '#');
+  writeFile(path, text.substr(0, 100));
+  DiskChange change = follow ? buffer.readAppended() : buffer.syncWithDisk();
+  if (change != DiskChange::Conflict) {
+    cerr << name << ": truncation not reported as a conflict\n";
+    return false;
+  }
+  size_t bytes = 0;
+  for (int r = 0; r < buffer.getLineCount(); r++) bytes += buffer.getLine(r).size();
+  if (buffer.getLine(0) != "#" + text.substr(0, text.find('\n')) || bytes > 101) {
+    cerr << name << ": buffer does not hold what is left of the file\n";
+    return false;
+  }
+  return true;
+}
+
+static string numbered(int lines) {
+  string text;
+  for (int i = 0; i < lines; i++) text += "line " + to_string(i) + "\n";
+  return text;
+}
+
+int main() {
+  // Below InPlaceMinFileSize files are rewritten; above it small edits are
+  // patched in place.
+  string small = numbered(20000), large = numbered(100000);
+  string replaced = large;
+  replaced.replace(10, 3, "XYZ");
+  bool ok = true;
+  for (bool replace : {false, true}) {
+    string how = replace ? "replace, " : "insert, ";
+    ok &= mergeThenSave(how + "small, prepend", small, "new\n" + small, 15000, 3, replace);
+    ok &= mergeThenSave(how + "small, append", small, small + "tail\n", 100, 3, replace);
+    ok &= mergeThenSave(how + "large, prepend", large, "new\n" + large, 90000, 3, replace);
+    ok &= mergeThenSave(how + "large, drop first line", large, large.substr(large.find('\n') + 1), 90000, 3, replace);
+    ok &= mergeThenSave(how + "large, append", large, large + "tail\n", 100, 3, replace);
+    ok &= mergeThenSave(how + "large, same-size change", large, replaced, 90000, 3, replace);
+  }
+  for (StorageKind storage : {StorageKind::Mapped, StorageKind::Paged}) {
+    string kind = storage == StorageKind::Mapped ? "mapped, " : "paged, ";
+    ok &= truncateWhileModified(kind + "truncated", storage, large, false);
+    ok &= truncateWhileModified(kind + "truncated while followed", storage, large, true);
+  }
+  if (ok) cout << "ok\n";
+  return ok ? 0 : 1;
+}